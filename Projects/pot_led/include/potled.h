@@ -3,6 +3,37 @@
 
 #define b2m(b) (1<<(b))
 
+// Ms between pot samples, and samples sent per frame
+// NOTE a frame (TWI_FRM_LEN(POTLED_BATCH)) must fit in the
+// other board's TWI_MAX_BUF
+#define POTLED_SAMPLE_MS    25
+#define POTLED_BATCH        4
+
+// ADC conversions per sample kept (see adcInit()), when triggered 
+// by Timer 1 (or by adcSleep() from loop() on each Timer 1 compare 
+// B match) there is a conversion per timer period (1 ms)
+#if ADC_TRIGGER == ADC_TRIG_T1_COMPB || ADC_TRIGGER == ADC_TRIG_SLEEP
+#define POTLED_ADC_DIV      POTLED_SAMPLE_MS
+#else
+#define POTLED_ADC_DIV      (ADC_MAX_SPS * POTLED_SAMPLE_MS / 1000)
+#endif
+
+// 0: Send our pot samples to the other board every POTLED_BATCH 
+//    samples, if they changed
+// 1: Fetch the other board's pot value every POTLED_BATCH samples 
+//    (read from it)
+#ifndef POTLED_FETCH_REMOTE
+#define POTLED_FETCH_REMOTE 0
+#endif
+
+// 0: Send our pot samples to TWI_REMOTE_ADDRESS only
+// 1: Broadcast them (General Call), one transaction updates 
+//    every board on the bus
+// NOTE all boards receive the General Call
+#ifndef POTLED_BROADCAST
+#define POTLED_BROADCAST    0
+#endif
+
 #if defined(__AVR_ATmega328P__)
 
 #define ISR_Timer1_CompB    __vector_ ## 12
@@ -1,4 +1,10 @@
+#include <string.h>
+
+#include <regs.h>
 #include <adc.h>
+#include <adcapi.h>
+#include <adcflt.h>
+#include <twiapi.h>
 
 #if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega2560__)
 
@@ -22,6 +28,325 @@ volatile uint8_t * const pui8Didr2  = (uint8_t *)DIDR2_ADDR;
 #endif
 volatile uint8_t * const pui8Didr0  = (uint8_t *)DIDR0_ADDR;
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+    void ISR_Adc(void)
+    __attribute__ ((signal,used,externally_visible));
+#ifdef __cplusplus
+}
+#endif
+
+static_assert(ADC_MAX_SCAN >= 1 && ADC_MAX_SCAN <= ADC_CHANNELS,
+              "ADC_MAX_SCAN must be between 1 and ADC_CHANNELS");
+
+// Sample rings, one per scanned channel, single producer (ISR_Adc) 
+// single consumer (adcRead). Indices are free running, only masked 
+// when accessing the ring, so head - tail is the number of samples. 
+// Being uint8_t they are read/written atomically, no need for 
+// critical sections.
+#define ADC_RING_MASK       (ADC_RING_DEPTH - 1)
+static_assert((ADC_RING_DEPTH & ADC_RING_MASK) == 0 &&
+              ADC_RING_DEPTH <= 128,
+              "ADC_RING_DEPTH must be a power of 2, up to 128");
+static volatile uint16_t g_adcRing[ADC_MAX_SCAN][ADC_RING_DEPTH];
+static volatile uint8_t g_adcHead[ADC_MAX_SCAN];    // Written only by ISR_Adc
+static volatile uint8_t g_adcTail[ADC_MAX_SCAN];    // Written only by adcRead
+
+// Sum of the conversions making the next sample, per channel
+static volatile uint16_t g_adcAcc[ADC_MAX_SCAN];
+
+#if ADC_FILTER
+// Filter state, per channel (only used by ISR_Adc)
+static adcFilter_t g_adcFlt[ADC_MAX_SCAN];
+#endif
+
+typedef struct __adcContext_t
+{
+    // Channels scanned (see ADC_CH()), how many, 
+    // and the one being converted
+    uint8_t scan[ADC_MAX_SCAN];
+    uint8_t scanCount;
+    uint8_t scanIdx;
+
+    // Conversions to throw away before the next one is kept,
+    // while the input settles after switching channel/reference
+    uint8_t discard;
+
+    // Passes over the channels between samples stored, and passes 
+    // made since the last one stored. The last ADC_OVERSAMPLE 
+    // passes make the sample.
+    uint16_t div;
+    uint16_t pass;
+
+    // ADCSRA value while converting
+    uint8_t adcsra;
+} adcContext_t;
+
+static volatile adcContext_t g_adc;
+
+// Driver statistics
+static volatile adcStats_t g_adcStats;
+
+// Select the channel (and reference) for the next conversion,
+// return the conversions to discard before the input is settled
+// ONLY CALLED FROM ISR_Adc (or before it is enabled)
+static uint8_t adcSelect(uint8_t ch)
+{
+    uint8_t discard = (g_adc.scanCount > 1) ? ADC_SCAN_SETTLE : 0;
+
+    if ((ADMUX ^ ch) & ADC_REF_MASK)
+    {
+        // Reference changed, the first conversion is not accurate
+        discard += ADC_REF_SETTLE;
+    }
+
+    ADMUX = (ch & ADC_REF_MASK) | (ch & 0x7);
+#if defined(__AVR_ATmega2560__)
+    // ADC8 to ADC15 are selected with MUX5
+    if (ch & 0x8)
+    {
+        ADCSRB |= b2m(ADCSRB_BIT_MUX5);
+    }
+    else
+    {
+        ADCSRB &= ~b2m(ADCSRB_BIT_MUX5);
+    }
+#endif
+
+    return discard;
+}
+
+void adcInitScan(const uint8_t *channels, uint8_t count, uint16_t div)
+{
+    uint8_t i;
+    uint8_t ch;
+
+    // Stop converting, if we were
+    ADCSRA = ADCSRA_DIV128;
+
+    if (count == 0 || count > ADC_MAX_SCAN)
+    {
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        ch = channels[i];
+        g_adc.scan[i] = ch;
+        g_adcHead[i] = 0;
+        g_adcTail[i] = 0;
+        g_adcAcc[i] = 0;
+#if ADC_FILTER
+        adcFilterInit(&g_adcFlt[i]);
+#endif
+
+        // Disable the digital input of the pins we convert
+#if defined(__AVR_ATmega2560__)
+        if (ch & 0x8)
+        {
+            DIDR2 |= b2m(ch & 0x7);
+        }
+        else
+#endif
+        {
+            DIDR0 |= b2m(ch & 0x7);
+        }
+    }
+    g_adc.scanCount = count;
+    g_adc.scanIdx = 0;
+    g_adc.div = (div > ADC_OVERSAMPLE) ? div : ADC_OVERSAMPLE;
+    g_adc.pass = 0;
+    memset((void *)&g_adcStats, 0, sizeof(g_adcStats));
+
+    // Configure the ADC as:
+    //
+    // ADCSRA   ADPS2:0 = 111b Pre-scaler divide by 128 (see ADC_MAX_SPS)
+    // ADCSRA   ADATE = 0b Single conversions, each one started 
+    //          by ISR_Adc once the previous one is done
+    //          ADATE = 1b (ADC_TRIG_T1_COMPB) Auto trigger, each one 
+    //          started by the timer, ISR_Adc only selects the channel
+    // ADCSRA   ADIE = 1b Interrupt on conversion complete
+    // ADCSRB   ADTS2:0 = 101b (ADC_TRIG_T1_COMPB) Trigger on Timer1 
+    //          Compare Match B
+    // ADCSRA   ADSC (ADC_TRIG_SLEEP) Not set, adcSleep() starts each
+    //          conversion
+    // ADMUX    REFS1:0 Reference, as given for the channel
+    // ADMUX    ADLAR = 0b Right adjust
+    // ADMUX    MUX4:0 (and MUX5) Channel, single ended
+    //
+    // NOTE Free running mode is not used as the MUX would only 
+    // change for the conversion after the one already started
+#if ADC_TRIGGER == ADC_TRIG_T1_COMPB
+    g_adc.adcsra = ADCSRA_DIV128 | b2m(ADCSRA_BIT_ADEN) | 
+                   b2m(ADCSRA_BIT_ADATE) | b2m(ADCSRA_BIT_ADIE);
+    ADCSRB = ADCSRB_ADTS_T1_COMPB;
+    g_adc.discard = adcSelect(g_adc.scan[0]);
+    ADCSRA = g_adc.adcsra | b2m(ADCSRA_BIT_ADIF);   // Wait for the timer
+#elif ADC_TRIGGER == ADC_TRIG_SLEEP
+    g_adc.adcsra = ADCSRA_DIV128 | b2m(ADCSRA_BIT_ADEN) | 
+                   b2m(ADCSRA_BIT_ADIE);
+    ADCSRB = ADCSRB_ADTS_FREE;
+    g_adc.discard = adcSelect(g_adc.scan[0]);
+    ADCSRA = g_adc.adcsra | b2m(ADCSRA_BIT_ADIF);   // Wait for adcSleep()
+#else
+    g_adc.adcsra = ADCSRA_DIV128 | b2m(ADCSRA_BIT_ADEN) | 
+                   b2m(ADCSRA_BIT_ADIE);
+    ADCSRB = ADCSRB_ADTS_FREE;
+    g_adc.discard = adcSelect(g_adc.scan[0]);
+    ADCSRA = g_adc.adcsra | b2m(ADCSRA_BIT_ADIF) | 
+             b2m(ADCSRA_BIT_ADSC);  // Start the first conversion
+#endif
+}
+
+void adcInit(uint8_t channel, uint16_t div)
+{
+    uint8_t ch = ADC_CH(channel, ADC_REF_AVCC);
+
+    adcInitScan(&ch, 1, div);
+}
+
+// May be called from loop() or an ISR
+uint8_t adcAvailable(uint8_t idx)
+{
+    return (uint8_t)(g_adcHead[idx] - g_adcTail[idx]);
+}
+
+// Only one consumer allowed per channel, it may be an ISR or loop()
+uint8_t adcRead(uint8_t idx, uint16_t *samples, uint8_t max)
+{
+    uint8_t tail = g_adcTail[idx];
+    uint8_t head = g_adcHead[idx];
+    uint8_t n = 0;
+
+    while (tail != head && n < max)
+    {
+        samples[n] = g_adcRing[idx][tail & ADC_RING_MASK];
+        tail++;
+        n++;
+    }
+    g_adcTail[idx] = tail;
+
+    return n;
+}
+
+// Get a copy of the driver statistics
+// May be called from loop() or an ISR
+void adcGetStats(adcStats_t *stats)
+{
+    uint8_t sreg = SREG;
+
+    // Counters are updated from ISR_Adc and are more than 8 bits
+    asm volatile("cli" ::);
+    memcpy((void *)stats, (const void *)&g_adcStats, sizeof(adcStats_t));
+    SREG = sreg;
+}
+
+// Store a sample of the channel at idx of the scan
+// ONLY CALLED FROM ISR_Adc
+static inline void adcStore(uint8_t idx, uint16_t data)
+{
+    uint8_t head = g_adcHead[idx];
+
+    if ((uint8_t)(head - g_adcTail[idx]) < ADC_RING_DEPTH)
+    {
+        g_adcRing[idx][head & ADC_RING_MASK] = data;
+        g_adcHead[idx] = head + 1;
+        g_adcStats.samples++;
+    }
+    else
+    {
+        g_adcStats.overruns++;
+    }
+}
+
+// ADC Conversion Complete
+void ISR_Adc(void)
+{
+    uint16_t data = ADC;
+    uint16_t acc;
+    uint8_t idx = g_adc.scanIdx;
+
+    if (g_adc.discard)
+    {
+        // Input was not settled, convert the same channel again
+        g_adc.discard--;
+        g_adcStats.discarded++;
+    }
+    else
+    {
+        // 16 bits arithmetic only, ADC_OVERSAMPLE * 1023 fits
+        if (g_adc.pass >= g_adc.div - ADC_OVERSAMPLE)
+        {
+            acc = g_adcAcc[idx] + data;
+            if (g_adc.pass == g_adc.div - 1)
+            {
+                // Decimate (and filter)
+#if ADC_FILTER
+                adcStore(idx, adcFilter(&g_adcFlt[idx], acc >> ADC_OVERSAMPLE_BITS));
+#else
+                adcStore(idx, acc >> ADC_OVERSAMPLE_BITS);
+#endif
+                acc = 0;
+            }
+            g_adcAcc[idx] = acc;
+        }
+
+        // Next channel, and pass once all were converted
+        idx++;
+        if (idx >= g_adc.scanCount)
+        {
+            idx = 0;
+            g_adc.pass = (g_adc.pass + 1 < g_adc.div) ? g_adc.pass + 1 : 0;
+        }
+        g_adc.scanIdx = idx;
+        if (g_adc.scanCount > 1)
+        {
+            g_adc.discard = adcSelect(g_adc.scan[idx]);
+        }
+    }
+
+#if ADC_TRIGGER == ADC_TRIG_CHAINED
+    // Start the next conversion
+    ADCSRA = g_adc.adcsra | b2m(ADCSRA_BIT_ADSC);
+#endif
+    // Otherwise the next match of the timer, or adcSleep(), starts it
+}
+
+#if ADC_TRIGGER == ADC_TRIG_SLEEP
+// ONLY CALLED FROM loop(), interrupts enabled
+bool adcSleep(void)
+{
+    bool slept = false;
+
+    // No interrupt may queue a TWI packet between checking
+    // and going to sleep
+    asm volatile("cli" ::);
+    if (ADCSRA & b2m(ADCSRA_BIT_ADSC))
+    {
+        // Previous conversion not done
+    }
+    else if (twiBusy())
+    {
+        // Stopping the I/O clock would stall TWI, convert awake
+        ADCSRA = g_adc.adcsra | b2m(ADCSRA_BIT_ADSC);
+    }
+    else
+    {
+        // Entering ADC Noise Reduction mode starts the conversion.
+        // The instruction after sei is always executed before any 
+        // interrupt, so nothing runs before we sleep
+        SMCR = SMCR_SM_ADC_NR | b2m(SMCR_BIT_SE);
+        asm volatile("sei" "\n\t" "sleep" ::);
+        SMCR = 0;
+        slept = true;
+    }
+    asm volatile("sei" ::);
+
+    return slept;
+}
+#endif
+
 #else
 #error Unsupported
 #endif
\ No newline at end of file
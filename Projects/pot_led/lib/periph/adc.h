@@ -4,6 +4,20 @@
 #include <undef.h>
 #include <stdint.h>
 
+#if defined(__AVR_ATmega328P__)
+
+#define ISR_Adc             __vector_ ## 21     // ADC Conversion Complete
+#define ADC_CHANNELS        8                   // ADC0 to ADC7
+
+#elif defined(__AVR_ATmega2560__)
+
+#define ISR_Adc             __vector_ ## 29     // ADC Conversion Complete
+#define ADC_CHANNELS        16                  // ADC0 to ADC15
+
+#else
+#error Unsupported 
+#endif
+
 #if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega2560__)
 
 //
@@ -67,6 +81,9 @@ extern volatile uint8_t * const pui8Didr0;
 #define ADCSRB_BIT_ADTS2    2       // ADTS2 ADC Auto Trigger Source bit 2
 #define ADCSRB_BIT_ADTS1    1       // ADTS1 ADC Auto Trigger Source bit 1
 #define ADCSRB_BIT_ADTS0    0       // ADTS0 ADC Auto Trigger Source bit 0
+#define ADCSRB_ADTS_MASK    0x7     // Auto Trigger Source
+#define ADCSRB_ADTS_FREE    0x0     // Auto Trigger Source, free running mode
+#define ADCSRB_ADTS_T1_COMPB 0x5    // Auto Trigger Source, Timer/Counter1 Compare Match B
 
 // ADMUX bit definitions
 #define ADMUX_BIT_REFS1     7       // REFS1 Reference Selection bit 1
@@ -0,0 +1,158 @@
+#ifndef __ADCAPI_H__
+#define __ADCAPI_H__
+
+#include <stdint.h>
+
+#include <adc.h>
+
+// Number of samples, per channel, that can be held until read 
+// with adcRead(), must be a power of 2
+#ifndef ADC_RING_DEPTH
+#define ADC_RING_DEPTH      16
+#endif
+
+// Maximum number of channels scanned (see adcInitScan()),
+// each one takes a ring of ADC_RING_DEPTH samples
+#ifndef ADC_MAX_SCAN
+#define ADC_MAX_SCAN        ADC_CHANNELS
+#endif
+
+// Conversions discarded after switching to another channel, 
+// for sources with a high impedance (above 10K) that need
+// more time than the sample and hold gives them to settle
+#ifndef ADC_SCAN_SETTLE
+#define ADC_SCAN_SETTLE     0
+#endif
+
+// Conversions discarded after switching reference, the first one
+// after the change is not accurate (see data sheet "ADC Voltage 
+// Reference")
+#ifndef ADC_REF_SETTLE
+#define ADC_REF_SETTLE      1
+#endif
+
+// Oversampling and decimation: each sample is the sum of 
+// 4^ADC_OVERSAMPLE_BITS conversions shifted right ADC_OVERSAMPLE_BITS
+// bits, gaining that many bits of resolution (up to 3, the sum must 
+// fit in 16 bits). It requires some noise on the input (at least 
+// 1 LSB), otherwise all conversions are the same and nothing is gained
+#ifndef ADC_OVERSAMPLE_BITS
+#define ADC_OVERSAMPLE_BITS 0
+#endif
+
+static_assert(ADC_OVERSAMPLE_BITS <= 3, "ADC_OVERSAMPLE_BITS up to 3");
+
+// Conversions per sample, and bits per sample
+#define ADC_OVERSAMPLE      (1 << (2 * ADC_OVERSAMPLE_BITS))
+#define ADC_SAMPLE_BITS     (10 + ADC_OVERSAMPLE_BITS)
+
+// 1: Samples go through a filter stage (see adcflt.h) in ISR_Adc,
+//    per channel, before being stored
+#ifndef ADC_FILTER
+#define ADC_FILTER          0
+#endif
+
+// What starts each conversion
+#define ADC_TRIG_CHAINED    0   // ISR_Adc, as soon as the previous one is done
+#define ADC_TRIG_T1_COMPB   1   // Timer/Counter1 Compare Match B (auto trigger)
+#define ADC_TRIG_SLEEP      2   // adcSleep()
+
+// Conversions are started by ADC_TRIG_CHAINED or ADC_TRIG_T1_COMPB.
+// Auto triggered conversions start on the timer edge, with no CPU
+// involved, so samples are evenly spaced (within an ADC clock) no 
+// matter what the ISRs are doing. 
+// NOTE the trigger is the rising edge of the OCF1B flag, it must be 
+// cleared before the next match (enable OCIE1B with an 
+// ISR_Timer1_CompB), otherwise only the first match converts.
+// Conversions started by adcSleep() run in ADC Noise Reduction sleep 
+// mode, with the CPU and I/O clocks stopped.
+#ifndef ADC_TRIGGER
+#define ADC_TRIGGER         ADC_TRIG_CHAINED
+#endif
+
+static_assert(ADC_TRIGGER == ADC_TRIG_CHAINED || ADC_TRIGGER == ADC_TRIG_T1_COMPB ||
+              ADC_TRIGGER == ADC_TRIG_SLEEP,
+              "ADC_TRIGGER must be ADC_TRIG_CHAINED, ADC_TRIG_T1_COMPB or ADC_TRIG_SLEEP");
+
+// References (as REFS1:0 bits in ADMUX)
+#define ADC_REF_MASK        0xc0
+#define ADC_REF_AREF        0x00    // External AREF
+#define ADC_REF_AVCC        0x40    // AVcc
+#if defined(__AVR_ATmega2560__)
+#define ADC_REF_1V1         0x80    // Internal 1.1V
+#define ADC_REF_2V56        0xc0    // Internal 2.56V
+#else
+#define ADC_REF_1V1         0xc0    // Internal 1.1V
+#endif
+
+// Channel to scan: analog input (0 to ADC_CHANNELS - 1),
+// single ended, against reference
+#define ADC_CH(input, ref)  ((uint8_t)((ref) | ((input) & 0xf)))
+
+// Conversions per second at most: ADC clock is F_CPU/128
+// (125KHz at 16MHz, it must be within 50-200KHz for 10 bits of 
+// resolution) and a conversion takes 13 ADC clocks, 9.6K at 16MHz.
+// Starting each conversion from ISR_Adc costs up to 1 ADC clock more
+#define ADC_MAX_SPS         (F_CPU / 128 / 13)
+
+// Driver statistics (see adcGetStats())
+typedef struct __adcStats_t
+{
+    // Samples stored in the ring
+    uint16_t samples;
+
+    // Samples dropped, the ring was full (consumer is behind)
+    uint16_t overruns;
+
+    // Conversions discarded while the input settled
+    uint16_t discarded;
+} adcStats_t;
+
+// Start scanning count channels (see ADC_CH()) round-robin,
+// interrupt driven, one channel per conversion. Each conversion is
+// started as set by ADC_TRIGGER: as soon as the previous one is 
+// done, on each Timer1 compare B match, or by adcSleep().
+// Conversions after switching channel/reference are discarded as
+// needed (see ADC_SCAN_SETTLE and ADC_REF_SETTLE).
+// Samples are stored in a ring per channel, one of every div passes
+// over the channels, i.e. about ADC_MAX_SPS / (count * div) samples 
+// per second per channel (when triggered by Timer1 or adcSleep(), 
+// their rate instead of ADC_MAX_SPS).
+// When oversampling, each sample is made of the last ADC_OVERSAMPLE
+// passes (div is at least that).
+// The digital inputs of the channels are disabled.
+void adcInitScan(const uint8_t *channels, uint8_t count, uint16_t div);
+
+// Same as adcInitScan() for a single channel (analog input ADC0 to 
+// ADC7, or ADC15 on the Mega), against AVcc
+void adcInit(uint8_t channel, uint16_t div);
+
+// Number of samples waiting to be read for the channel at idx
+// of the scan (0 if converting a single channel)
+uint8_t adcAvailable(uint8_t idx);
+
+// Read up to max samples (ADC_SAMPLE_BITS bits, right adjusted), 
+// oldest first,
+// of the channel at idx of the scan (0 if converting a single channel)
+// Only one consumer allowed per channel, it may be an ISR or loop()
+// Return the number of samples read
+uint8_t adcRead(uint8_t idx, uint16_t *samples, uint8_t max);
+
+// Get a copy of the driver statistics
+void adcGetStats(adcStats_t *stats);
+
+#if ADC_TRIGGER == ADC_TRIG_SLEEP
+// Convert the next channel of the scan in ADC Noise Reduction sleep 
+// mode: the CPU and I/O clocks (hence their digital noise) are 
+// stopped until the conversion completes, ISR_Adc wakes us up.
+// TWI is never stalled: while it is busy (see twiBusy()) the 
+// conversion is made awake instead. Nothing is started if the
+// previous conversion is not done.
+// NOTE Timers clocked from the I/O clock (Timer0/1) stop too, for a
+// conversion (about 1000000 / ADC_MAX_SPS us)
+// ONLY CALLED FROM loop(), interrupts enabled
+// Return true if we slept
+bool adcSleep(void);
+#endif
+
+#endif // __ADCAPI_H__
\ No newline at end of file
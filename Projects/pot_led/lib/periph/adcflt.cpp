@@ -0,0 +1,75 @@
+#include <adcflt.h>
+
+void adcFilterInit(adcFilter_t *flt)
+{
+    flt->primed = false;
+}
+
+#if ADC_FLT_MEDIAN > 1
+// Median of the window, sorting a copy (insertion sort, 
+// the window is only a few samples)
+static uint16_t adcMedian(const uint16_t *window)
+{
+    uint16_t sorted[ADC_FLT_MEDIAN];
+    uint16_t value;
+    uint8_t i;
+    uint8_t j;
+
+    for (i = 0; i < ADC_FLT_MEDIAN; i++)
+    {
+        value = window[i];
+        for (j = i; j > 0 && sorted[j - 1] > value; j--)
+        {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = value;
+    }
+
+    return sorted[ADC_FLT_MEDIAN / 2];
+}
+#endif
+
+uint16_t adcFilter(adcFilter_t *flt, uint16_t sample)
+{
+    uint16_t value;
+#if ADC_FLT_MEDIAN > 1
+    uint8_t i;
+#endif
+
+    if (!flt->primed)
+    {
+        // Start as if the input had always been at sample
+#if ADC_FLT_MEDIAN > 1
+        for (i = 0; i < ADC_FLT_MEDIAN; i++)
+        {
+            flt->window[i] = sample;
+        }
+        flt->next = 0;
+#endif
+        flt->ema = sample << ADC_FLT_EMA_SHIFT;
+        flt->out = sample;
+        flt->primed = true;
+
+        return sample;
+    }
+
+#if ADC_FLT_MEDIAN > 1
+    flt->window[flt->next] = sample;
+    flt->next = (flt->next + 1 < ADC_FLT_MEDIAN) ? flt->next + 1 : 0;
+    value = adcMedian(flt->window);
+#else
+    value = sample;
+#endif
+
+    // ema += (value - ema) / 2^shift, kept scaled by 2^shift:
+    // it settles at exactly value << shift (plus fraction bits)
+    flt->ema = flt->ema - (flt->ema >> ADC_FLT_EMA_SHIFT) + value;
+    value = flt->ema >> ADC_FLT_EMA_SHIFT;
+
+    if (value > flt->out + ADC_FLT_HYST || value + ADC_FLT_HYST < flt->out)
+    {
+        flt->out = value;
+    }
+
+    return flt->out;
+}
\ No newline at end of file
@@ -0,0 +1,70 @@
+#ifndef __ADCFLT_H__
+#define __ADCFLT_H__
+
+#include <stdint.h>
+
+#include <adcapi.h>
+
+//
+// Filter stage for ADC samples, fixed point (16 bits) only
+//
+// sample -> median of ADC_FLT_MEDIAN -> EMA -> hysteresis -> output
+//
+// The median drops isolated spikes, the EMA (exponential moving 
+// average) smooths noise, and the hysteresis keeps the output still
+// while the input hovers around a value, so a pot left alone does 
+// not produce any changes. Out of the band the output follows the 
+// input at once, so step response is only delayed by the EMA.
+//
+
+// Samples the median is taken from, 1 (no median), 3 or 5
+#ifndef ADC_FLT_MEDIAN
+#define ADC_FLT_MEDIAN      1
+#endif
+
+// EMA weight of each new sample is 1 / 2^ADC_FLT_EMA_SHIFT,
+// 0 for no EMA
+#ifndef ADC_FLT_EMA_SHIFT
+#define ADC_FLT_EMA_SHIFT   2
+#endif
+
+// Hysteresis band, in LSB of the samples filtered (ADC_SAMPLE_BITS), 
+// the output only changes once the filtered value is further away
+// from it than this
+#ifndef ADC_FLT_HYST
+#define ADC_FLT_HYST        0
+#endif
+
+static_assert(ADC_FLT_MEDIAN == 1 || ADC_FLT_MEDIAN == 3 || ADC_FLT_MEDIAN == 5,
+              "ADC_FLT_MEDIAN must be 1, 3 or 5");
+static_assert(ADC_SAMPLE_BITS + ADC_FLT_EMA_SHIFT <= 16,
+              "ADC_FLT_EMA_SHIFT too big for 16 bits");
+static_assert(ADC_FLT_HYST < (1 << ADC_SAMPLE_BITS), "ADC_FLT_HYST too big");
+
+// Filter state, one per channel filtered
+typedef struct __adcFilter_t
+{
+#if ADC_FLT_MEDIAN > 1
+    // Last samples, and where the next one goes
+    uint16_t window[ADC_FLT_MEDIAN];
+    uint8_t next;
+#endif
+
+    // EMA, in fixed point with ADC_FLT_EMA_SHIFT fraction bits
+    uint16_t ema;
+
+    // Filter output
+    uint16_t out;
+
+    // Set by the first sample
+    bool primed;
+} adcFilter_t;
+
+// Reset the filter, the next sample goes straight to the output
+void adcFilterInit(adcFilter_t *flt);
+
+// Filter a sample
+// Return the filter output
+uint16_t adcFilter(adcFilter_t *flt, uint16_t sample);
+
+#endif // __ADCFLT_H__
\ No newline at end of file
@@ -10,6 +10,7 @@
 //
 
 // Memory mapped IO addresses
+volatile uint8_t * const pui8Smcr = (uint8_t *)SMCR_ADDR;       // Register SMCR
 volatile uint8_t * const pui8Sreg = (uint8_t *)SREG_ADDR;       // Register SREG
 volatile uint8_t * const pui8Prr0 = (uint8_t *)PRR0_ADDR;       // Register PRR/PRR0
 
@@ -13,19 +13,31 @@
 // the same address.
 //
 
+#define SMCR_ADDR           0x53
 #define SREG_ADDR           0x5f
 #define PRR0_ADDR           0x64
 
 // Memory mapped IO addresses
+extern volatile uint8_t * const pui8Smcr;       // Register SMCR
 extern volatile uint8_t * const pui8Sreg;       // Register SREG
 extern volatile uint8_t * const pui8Prr0;       // Register PRR (Uno) / PRR0 (Mega)
 
+#define SMCR (*pui8Smcr)
 #define SREG (*pui8Sreg)
 #define PRR0 (*pui8Prr0)
 
 // Other control register bit definitions
 #define PRR0_BIT_PRTWI      7                   // PRTWI: Power Reduction TWI
 
+// SMCR bit definitions
+#define SMCR_BIT_SM2        3                   // SM2: Sleep Mode Select bit 2
+#define SMCR_BIT_SM1        2                   // SM1: Sleep Mode Select bit 1
+#define SMCR_BIT_SM0        1                   // SM0: Sleep Mode Select bit 0
+#define SMCR_BIT_SE         0                   // SE: Sleep Enable
+// Sleep modes (as SM2:0 bits in SMCR)
+#define SMCR_SM_IDLE        0x0                 // Sleep mode, Idle
+#define SMCR_SM_ADC_NR      0x2                 // Sleep mode, ADC Noise Reduction
+
 #else
 #error Unsupported
 #endif
@@ -13,6 +13,7 @@
 // Memory mapped IO addresses for Timer 1
 volatile uint8_t * const pui8Tccr1A = (uint8_t *)TCCR1A_ADDR;   // Register TCCR1A
 volatile uint8_t * const pui8Tccr1B = (uint8_t *)TCCR1B_ADDR;   // Register TCCR1B
+volatile uint16_t * const pui16Tcnt1 = (uint16_t *)TCNT1_ADDR;  // Register TCNT1
 volatile uint16_t * const pui16Ocr1A = (uint16_t *)OCR1A_ADDR;  // Register OCR1B
 volatile uint16_t * const pui16Ocr1B = (uint16_t *)OCR1B_ADDR;  // Register OCR1B
 volatile uint16_t * const pui16Icr1 = (uint16_t *)ICR1_ADDR;    // Register ICR1
@@ -16,6 +16,7 @@
 
 #define TCCR1A_ADDR         0x80    // Timer/Counter1 Control Register A
 #define TCCR1B_ADDR         0x81    // Timer/Counter1 Control Register B
+#define TCNT1_ADDR          0x84    // Timer/Counter1
 #define OCR1A_ADDR          0x88    // Output Compare Register 1 A
 #define OCR1B_ADDR          0x8a    // Output Compare Register 1 B
 #define ICR1_ADDR           0x86    // Input Capture Register 1
@@ -24,6 +25,7 @@
 // Memory mapped IO addresses for Timer 1
 extern volatile uint8_t * const pui8Tccr1A;   // Register TCCR1A
 extern volatile uint8_t * const pui8Tccr1B;   // Register TCCR1B
+extern volatile uint16_t * const pui16Tcnt1;  // Register TCNT1
 extern volatile uint16_t * const pui16Ocr1A;  // Register OCR1A
 extern volatile uint16_t * const pui16Ocr1B;  // Register OCR1B
 extern volatile uint16_t * const pui16Icr1;    // Register ICR1
@@ -31,6 +33,7 @@ extern volatile uint8_t * const pui8Timsk1;   // Register TIMSK1
 
 #define TCCR1A              (*pui8Tccr1A)
 #define TCCR1B              (*pui8Tccr1B)
+#define TCNT1               (*pui16Tcnt1)
 #define OCR1A               (*pui16Ocr1A)
 #define OCR1B               (*pui16Ocr1B)
 #define ICR1                (*pui16Icr1)
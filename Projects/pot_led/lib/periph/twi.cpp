@@ -1,15 +1,64 @@
 #include <string.h>
 
 #include <dbg.h>
-#include <regs.h>
-#include <gpio.h>
 #include <twipriv.h>
 #include <twiapi.h>
 
 static volatile twiContext_t g_ctx;
-static volatile twiRxBuf_t g_rxBuf;
-static volatile twiTxBuf_t g_txBuf;
 
+// Receive ring, single producer (ISR_Twi) single consumer (twiRecv).
+// Indices are free running, only masked when accessing the ring, 
+// so head - tail is the number of completed packets. Being uint8_t 
+// they are read/written atomically, no need for critical sections.
+// Packet being received (if any) is stored at g_rxRing[g_rxHead],
+// it is published by incrementing g_rxHead once STOP is received.
+#define TWI_RX_QUEUE_MASK   (TWI_RX_QUEUE_DEPTH - 1)
+static_assert((TWI_RX_QUEUE_DEPTH & TWI_RX_QUEUE_MASK) == 0 && 
+              TWI_RX_QUEUE_DEPTH <= 128,
+              "TWI_RX_QUEUE_DEPTH must be a power of 2, up to 128");
+static volatile twiRxBuf_t g_rxRing[TWI_RX_QUEUE_DEPTH];
+static volatile uint8_t g_rxHead;   // Written only by ISR_Twi
+static volatile uint8_t g_rxTail;   // Written by twiRxRelease, or by
+                                    // ISR_Twi if !g_rxPeeked (see
+                                    // TWI_RX_DROP_OLDEST)
+static volatile bool g_rxPeeked;    // Consumer holds g_rxRing[g_rxTail]
+static volatile twiTxBuf_t g_txQueue[TWI_TX_QUEUE_DEPTH];
+
+// Segments of the packet in each send queue slot, if sent from
+// segments (TWI_TX_Segments, see twiSendSg())
+static volatile twiSeg_t g_txSegs[TWI_TX_QUEUE_DEPTH][TWI_TX_MAX_SEGS];
+
+// Data returned when a master reads from us (Slave Transmitter)
+static volatile uint8_t g_slaveTx[TWI_MAX_BUF];
+
+// Driver statistics
+static volatile twiStats_t g_stats;
+
+// Called once a packet is received (see twiRxCallback_t)
+static twiRxCallback_t g_rxCallback;
+
+// Longest wait is before the last attempt (none if only one)
+static_assert(TWI_TX_MAX_ATTEMPTS >= 1, "TWI_TX_MAX_ATTEMPTS must be at least 1");
+static_assert((TWI_TX_BACKOFF << (TWI_TX_MAX_ATTEMPTS > 2 ? TWI_TX_MAX_ATTEMPTS - 2 : 0)) <= 255,
+              "TWI_TX_BACKOFF too long for TWI_TX_MAX_ATTEMPTS");
+static_assert((TWI_ARB_WINDOW_MIN & (TWI_ARB_WINDOW_MIN - 1)) == 0 &&
+              (TWI_ARB_WINDOW_MAX & (TWI_ARB_WINDOW_MAX - 1)) == 0 &&
+              TWI_ARB_WINDOW_MIN <= TWI_ARB_WINDOW_MAX &&
+              TWI_ARB_WINDOW_MAX <= 128,
+              "TWI_ARB_WINDOW_MIN/MAX must be powers of 2, up to 128");
+static_assert(TWI_TX_MAX_ARB_LOSSES >= 1 && TWI_TX_MAX_ARB_LOSSES <= 255,
+              "TWI_TX_MAX_ARB_LOSSES must be 1 to 255");
+static_assert((TWI_TX_HOLD_WINDOW & (TWI_TX_HOLD_WINDOW - 1)) == 0 &&
+              TWI_TX_HOLD_WINDOW <= 128,
+              "TWI_TX_HOLD_WINDOW must be 0 or a power of 2, up to 128");
+static_assert(TWI_TX_BURST >= 1, "TWI_TX_BURST must be at least 1");
+static_assert(TWI_TX_MAX_SEGS >= 1, "TWI_TX_MAX_SEGS must be at least 1");
+static_assert(TWI_RX_FULL_POLICY == TWI_RX_DROP_NEWEST ||
+              TWI_RX_FULL_POLICY == TWI_RX_DROP_OLDEST ||
+              TWI_RX_FULL_POLICY == TWI_RX_NACK,
+              "Unknown TWI_RX_FULL_POLICY");
+
+#if !defined(TWI_HOST)
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,23 +67,45 @@ extern "C" {
 #ifdef __cplusplus
 }
 #endif
+#endif
 
-// Memory mapped IO addresses for TWI (I2C)
-volatile uint8_t * const pui8Twbr = (uint8_t *)TWBR_ADDR;  // Register TWBR
-volatile uint8_t * const pui8Twsr = (uint8_t *)TWSR_ADDR;  // Register TWSR
-volatile uint8_t * const pui8Twar = (uint8_t *)TWAR_ADDR;  // Register TWAR
-volatile uint8_t * const pui8Twdr = (uint8_t *)TWDR_ADDR;  // Register TWDR
-volatile uint8_t * const pui8Twcr = (uint8_t *)TWCR_ADDR;  // Register TWCR
-volatile uint8_t * const pui8Twamr = (uint8_t *)TWAMR_ADDR;// Register TWAMR
+// Both Standard-mode and Fast-mode must be reachable on our boards
+static_assert(TwiBitRate<TWI_SCL_STANDARD>::sclFreq <= TWI_SCL_STANDARD,
+              "Standard-mode not supported");
+static_assert(TwiBitRate<TWI_SCL_FAST>::sclFreq <= TWI_SCL_FAST,
+              "Fast-mode not supported");
 
-void twiInit(uint8_t slaveAddress)
+void twiInitRate(uint8_t slaveAddress, uint8_t options, uint8_t addrMask,
+                 twiRxCallback_t rxCallback, uint8_t twbr, uint8_t twps)
 {
     g_ctx.slaveAddr = slaveAddress & 0x7f;
     g_ctx.twiSending = false;
     g_ctx.twiReceiving = false;
+    g_ctx.rxDiscard = false;
+    g_ctx.rxNotify = false;
+    g_ctx.twiSlaveTx = false;
+    g_ctx.slaveTxLen = 0;
+    g_ctx.txReadPhase = false;
+    g_ctx.txHead = 0;
+    g_ctx.txCount = 0;
+    g_ctx.txAttempts = 0;
+    g_ctx.txBackoff = 0;
+    g_ctx.txArbLosses = 0;
+    g_ctx.txBurst = 0;
+    g_ctx.txWait = 0;
+    // Nodes have different addresses, so they get different 
+    // random sequences. Must not be 0.
+    g_ctx.rand = (g_ctx.slaveAddr << 1) | 1;
+    g_ctx.stallTicks = 0;
+    g_ctx.twiPolling = false;
+    g_rxCallback = rxCallback;
 
-    memset((void *)&g_rxBuf, 0, sizeof(g_rxBuf));
-    memset((void *)&g_txBuf, 0, sizeof(g_txBuf));
+    memset((void *)g_rxRing, 0, sizeof(g_rxRing));
+    g_rxHead = 0;
+    g_rxTail = 0;
+    g_rxPeeked = false;
+    memset((void *)g_txQueue, 0, sizeof(g_txQueue));
+    memset((void *)&g_stats, 0, sizeof(g_stats));
     
     // Enable internal pull-up resistors for SCL/SDA
     // See data-sheet section: "SCL and SDA Pins"
@@ -45,16 +116,21 @@ void twiInit(uint8_t slaveAddress)
 
     // Configure TWI (I2C)
     //
-    // SCL frequency: 100,000 Hz
+    // SCL frequency: As given by TWBR/TWPS (see twiInit())
     // Enable automatic ACK as we can receive at any time
     //
     // Communication modes will only be:
     //  * Master transmitter - When we have a pot read we send it
     //  * Slave receiver - When we receive a pot read we apply it
-    twiSetBitRateDivisionFactor(100, 0); // Will set TWPS1:0 and TWBR
+    //  * Master receiver - When we fetch the other board's pot read
+    //  * Slave transmitter - When the other board fetches our pot read
+    TWSR = twps & 0x3;
+    TWBR = twbr;
     TWCR = TWCR_MASK_READY;
-    TWAR = (g_ctx.slaveAddr << 1);  // Set slave address
-    TWAMR = 0;
+    // Set slave address, and whether we answer the General Call
+    TWAR = (g_ctx.slaveAddr << 1) | 
+           ((options & TWI_INIT_GENERAL_CALL) ? b2m(TWAR_BIT_TWGCE) : 0);
+    TWAMR = (addrMask & 0x7f) << 1;     // Address bits to ignore
 
     SerialPr(("TWSR:0x"));
     SerialPr((TWSR, 16));
@@ -64,42 +140,734 @@ void twiInit(uint8_t slaveAddress)
     SerialPrLn((TWCR, 16));
 }
 
+// Get the oldest packet received, in place
+// Only one consumer allowed, it may be an ISR or loop()
+const twiRxBuf_t *twiRxPeek(void)
+{
+    uint8_t tail;
+
+    // Flag it before reading g_rxTail, from then on ISR_Twi 
+    // does not drop the oldest packet (see TWI_RX_DROP_OLDEST)
+    g_rxPeeked = true;
+    tail = g_rxTail;
+    if (g_rxHead == tail)
+    {
+        g_rxPeeked = false;
+        return NULL;
+    }
+
+    return (const twiRxBuf_t *)&g_rxRing[tail & TWI_RX_QUEUE_MASK];
+}
+
+// Hand the packet obtained with twiRxPeek() back to ISR_Twi
+void twiRxRelease(void)
+{
+    if (g_rxHead != g_rxTail)
+    {
+        g_rxTail = g_rxTail + 1;
+    }
+    g_rxPeeked = false;
+}
+
 // Receive data
-// ONLY CALLED FROM WITHIN AN ISR
+// Only one consumer allowed, it may be an ISR or loop()
 bool twiRecv(twiRxBuf_t* recvBuf)
 {
-    bool received = false;
+    const twiRxBuf_t *rxBuf = twiRxPeek();
 
-    if (g_rxBuf.status & TWI_RX_RecvCompleted)
+    if (rxBuf == NULL)
     {
-        memcpy((void *)recvBuf, (void *)&g_rxBuf, sizeof(twiRxBuf_t));
-        memset((void *)&g_rxBuf, 0, sizeof(g_rxBuf));
-        received = true;
+        return false;
     }
 
-    return received;
+    memcpy((void *)recvBuf, (const void *)rxBuf, sizeof(twiRxBuf_t));
+    twiRxRelease();
+
+    return true;
 }
 
-// Send data
+// Start receiving a packet, sent to (or read from) addr,
+// into the next free slot of the ring
+// ONLY CALLED FROM ISR_Twi
+static void twiRxBegin(uint8_t status, uint8_t addr)
+{
+    volatile twiRxBuf_t *rxBuf;
+
+#if TWI_RX_FULL_POLICY == TWI_RX_DROP_OLDEST
+    if ((uint8_t)(g_rxHead - g_rxTail) >= TWI_RX_QUEUE_DEPTH && !g_rxPeeked)
+    {
+        // Make room, the consumer is not looking at the oldest one
+        g_rxTail = g_rxTail + 1;
+        g_stats.rxDropped++;
+    }
+#endif
+
+    if ((uint8_t)(g_rxHead - g_rxTail) < TWI_RX_QUEUE_DEPTH)
+    {
+        rxBuf = &g_rxRing[g_rxHead & TWI_RX_QUEUE_MASK];
+        rxBuf->size = 0;
+        rxBuf->status = status;
+        rxBuf->addr = addr;
+        g_ctx.rxDiscard = false;
+    }
+    else
+    {
+        // Consumer is behind, no room for this packet. A reply we 
+        // read as master, or a General Call packet, can not be 
+        // refused (NACKed), it is dropped
+        g_ctx.rxDiscard = true;
+        if (TWI_RX_FULL_POLICY != TWI_RX_NACK || 
+            (status & (TWI_RX_MasterRead | TWI_RX_DataFromGC)))
+        {
+            g_stats.rxDropped++;
+        }
+    }
+}
+
+// As slave receiver, action once addressed (after twiRxBegin()):
+// ACK the first data byte, or NACK it if there is no room for the
+// packet and the policy is to make the master send it again
+// ONLY CALLED FROM ISR_Twi
+static inline uint8_t twiRxAddressed(void)
+{
+#if TWI_RX_FULL_POLICY == TWI_RX_NACK
+    if (g_ctx.rxDiscard)
+    {
+        g_stats.rxNacked++;
+        return TWCR_ACT_NACK;
+    }
+#endif
+    return TWCR_ACT_ACK;
+}
+
+// Store a received byte in the packet being received
+// ONLY CALLED FROM ISR_Twi
+static void twiRxData(uint8_t data)
+{
+    volatile twiRxBuf_t *rxBuf = &g_rxRing[g_rxHead & TWI_RX_QUEUE_MASK];
+
+    if (g_ctx.rxDiscard)
+    {
+        return;
+    }
+
+    if (rxBuf->size < TWI_MAX_BUF)
+    {
+        rxBuf->buffer[rxBuf->size] = data;
+        rxBuf->size++;
+    }
+    else
+    {
+        // Overflow, count once per packet
+        if (!(rxBuf->status & TWI_RX_DataOverflow))
+        {
+            rxBuf->status |= TWI_RX_DataOverflow;
+            g_stats.rxOverflows++;
+        }
+    }
+}
+
+// Packet being received is complete, publish it to the consumer
+// ONLY CALLED FROM ISR_Twi
+static void twiRxPublish(void)
+{
+    if (!g_ctx.rxDiscard)
+    {
+        g_rxRing[g_rxHead & TWI_RX_QUEUE_MASK].status |= TWI_RX_RecvCompleted;
+        g_rxHead = g_rxHead + 1;
+        g_stats.rxFrames++;
+        g_ctx.rxNotify = true;
+    }
+}
+
+// Remove the packet at the head of the send queue
+// (sent or given up on)
+// Return true if there is another packet waiting to be sent
+static bool twiTxPop(void)
+{
+    g_ctx.txHead = (g_ctx.txHead + 1) % TWI_TX_QUEUE_DEPTH;
+    g_ctx.txCount--;
+    g_ctx.twiSending = (g_ctx.txCount != 0);
+    g_ctx.txAttempts = 0;
+    g_ctx.txArbLosses = 0;
+    if (g_ctx.txWait > g_stats.txMaxWait)
+    {
+        g_stats.txMaxWait = g_ctx.txWait;
+    }
+    g_ctx.txWait = 0;
+
+    return g_ctx.twiSending;
+}
+
+// Pseudo random number [1, 255], 8 bits Galois LFSR
+// (x^8+x^6+x^5+x^4+1, period 255)
+static uint8_t twiRand(void)
+{
+    uint8_t lfsr = g_ctx.rand;
+
+    lfsr = (lfsr >> 1) ^ ((lfsr & 1) ? 0xb8 : 0);
+    g_ctx.rand = lfsr;
+
+    return lfsr;
+}
+
+// Random wait (ms) in [1, window], window must be a power of 2
+static uint8_t twiRandWait(uint8_t window)
+{
+    return 1 + (twiRand() & (window - 1));
+}
+
+// Packet at the head of the send queue is done (sent or given up on),
+// send STOP, or a repeated START if there are more packets queued.
+// The queue acts as a pipeline: the next packets are filled while 
+// this one is on the wire, and are chained without the STOP and bus
+// free time in between, i.e. the bus never goes idle between them.
+// To be fair to other masters, after TWI_TX_BURST packets in a row
+// STOP and hold off for a random wait, giving them a chance to win
+// the bus. Same after a packet that had to wait for the bus but
+// never lost it (see TWI_TX_HOLD_WINDOW), queued or not.
 // ONLY CALLED FROM WITHIN AN ISR
-bool twiSend(twiTxBuf_t* sendBuf)
+static void twiTxEnd(void)
 {
-    bool started = false;
+    bool holdOff = (TWI_TX_HOLD_WINDOW && g_ctx.txWait &&
+                    !g_ctx.txArbLosses && !g_ctx.txAttempts);
 
-    if (!g_ctx.twiSending &&
-        sendBuf->len > 0 && sendBuf->len <= sizeof(sendBuf->buffer))
+    if (holdOff)
     {
-        // Note toAddr 0 (General Call address) is allowed
-        memcpy((void *)&g_txBuf, (void *)sendBuf, sizeof(twiTxBuf_t));
-        g_ctx.twiSending = true;
-        g_txBuf.size = 0;
-        g_txBuf.status = TWI_TX_Sending;
-        started = true;
-        if (!g_ctx.twiReceiving)
+        twiTxPop();
+        TWCR = TWCR_ACT_STOP;
+        g_ctx.txBurst = 0;
+        g_ctx.txBackoff = twiRandWait(TWI_TX_HOLD_WINDOW);
+    }
+    else if (!twiTxPop())
+    {
+        TWCR = TWCR_ACT_STOP;
+        g_ctx.txBurst = 0;
+    }
+    else if (++g_ctx.txBurst < TWI_TX_BURST)
+    {
+        // See 0x10, packets with nothing to write only read
+        g_ctx.txReadPhase = (g_txQueue[g_ctx.txHead].len == 0);
+        g_ctx.txRetry = 0;
+        TWCR = TWCR_ACT_START;
+    }
+    else
+    {
+        TWCR = TWCR_ACT_STOP;
+        g_ctx.txBurst = 0;
+        g_ctx.txBackoff = twiRandWait(TWI_ARB_WINDOW_MIN);
+    }
+}
+
+// Lost arbitration while sending the packet at the head of the 
+// send queue. Release the bus to the winner and send the whole
+// packet again after a random wait, within a window that halves
+// on each loss (down to TWI_ARB_WINDOW_MIN). Masters that collided
+// most likely pick different waits, instead of colliding again, and
+// the one losing most often gets back first (the winner may be
+// holding off, see twiTxEnd()).
+// After TWI_TX_MAX_ARB_LOSSES give up on the packet, the next one
+// (if any) waits all the same
+// ONLY CALLED FROM ISR_Twi
+static void twiTxArbLost(void)
+{
+    uint8_t window = TWI_ARB_WINDOW_MIN;
+
+    TWCR = TWCR_ACT_ACK;
+    g_stats.arbLosses++;
+    g_ctx.txArbLosses++;
+    if (g_ctx.txArbLosses < 8 &&
+        (TWI_ARB_WINDOW_MAX >> g_ctx.txArbLosses) > TWI_ARB_WINDOW_MIN)
+    {
+        window = TWI_ARB_WINDOW_MAX >> g_ctx.txArbLosses;
+    }
+    if (g_ctx.txArbLosses >= TWI_TX_MAX_ARB_LOSSES)
+    {
+        twiTxPop();
+        g_stats.txFailures++;
+        window = TWI_ARB_WINDOW_MIN;
+    }
+    g_ctx.txBackoff = twiRandWait(window);
+}
+
+// Attempt to send the packet at the head of the send queue failed,
+// write twcr to TWCR and wait (see twiTick()) before sending it again,
+// each attempt waits twice as long as the previous one.
+// Once out of attempts, give up on the packet.
+// ONLY CALLED FROM WITHIN AN ISR
+static void twiTxRetry(uint8_t twcr)
+{
+    g_ctx.txAttempts++;
+    if (g_ctx.txAttempts < TWI_TX_MAX_ATTEMPTS)
+    {
+        TWCR = twcr;
+        g_ctx.txBackoff = TWI_TX_BACKOFF << (g_ctx.txAttempts - 1);
+        g_stats.txRetries++;
+    }
+    else
+    {
+        // Failed to send packet, move on to the next one (if any)
+        twiTxEnd();
+        g_stats.txFailures++;
+    }
+}
+
+// SLA+R/W was sent but did not get ACK
+// Send a repeated START if allowed, otherwise retry later
+// ONLY CALLED FROM ISR_Twi
+static void twiTxAddrNack(void)
+{
+    if (g_ctx.txRetry < TWI_MAX_TX_RETRY)
+    {
+        TWCR = TWCR_ACT_START;
+        g_ctx.txRetry++;
+    }
+    else
+    {
+        twiTxRetry(TWCR_ACT_STOP);
+    }
+}
+
+// Wait about half an SCL period at 100KHz
+static void twiBusDelay(void)
+{
+    // Each iteration takes (at least) 4 CPU cycles
+    for (volatile uint8_t i = 0; i < (F_CPU / 1000000UL) * 5 / 4; i++)
+    {
+    }
+}
+
+// Watch SCL for about 200us (20 SCL periods at 100KHz, longer than
+// a slave usually stretches it), each spin takes (at least) 8 CPU
+// cycles
+#define TWI_BUS_WATCH_SPINS ((uint16_t)(F_CPU / 1000000UL * 200 / 8))
+
+// Tell whether the bus is moving, i.e. someone (another master)
+// is clocking it, as opposed to stuck (SCL held low) or idle
+// Return true if SCL was seen both low and high
+static bool twiBusMoving(void)
+{
+    uint8_t seen = 0;
+    uint16_t i;
+
+    for (i = 0; i < TWI_BUS_WATCH_SPINS && seen != 0x3; i++)
+    {
+        seen |= (TWI_PIN & b2m(TWI_SCL_PULL_UP)) ? 0x1 : 0x2;
+    }
+
+    return seen == 0x3;
+}
+
+// Free a stuck bus (e.g. a slave holding SDA low because it missed
+// clocks), with TWI disabled toggle SCL until SDA is released, then 
+// generate a STOP. SCL/SDA are only ever driven low, otherwise they
+// are inputs pulled up, as the bus is open drain.
+// See NXP UM10204 "I2C-bus specification", section "Bus clear"
+static void twiBusClear(void)
+{
+    uint8_t i;
+
+    TWCR = 0; // SCL/SDA back to being normal port pins
+    TWI_PORT &= ~(b2m(TWI_SCL_PULL_UP) | b2m(TWI_SDA_PULL_UP));
+
+    for (i = 0; i < 9 && !(TWI_PIN & b2m(TWI_SDA_PULL_UP)); i++)
+    {
+        TWI_DDR |= b2m(TWI_SCL_PULL_UP);    // SCL low
+        twiBusDelay();
+        TWI_DDR &= ~b2m(TWI_SCL_PULL_UP);   // SCL released
+        twiBusDelay();
+    }
+
+    // STOP: SDA going high while SCL is high
+    TWI_DDR |= b2m(TWI_SCL_PULL_UP);        // SCL low
+    twiBusDelay();
+    TWI_DDR |= b2m(TWI_SDA_PULL_UP);        // SDA low
+    twiBusDelay();
+    TWI_DDR &= ~b2m(TWI_SCL_PULL_UP);       // SCL released
+    twiBusDelay();
+    TWI_DDR &= ~b2m(TWI_SDA_PULL_UP);       // SDA released
+    twiBusDelay();
+
+    TWI_PORT |= (b2m(TWI_SCL_PULL_UP) | b2m(TWI_SDA_PULL_UP));
+    TWCR = TWCR_MASK_READY;
+}
+
+// Called every 1ms
+// ONLY CALLED FROM WITHIN AN ISR
+void twiTick(void)
+{
+    if (g_ctx.twiPolling)
+    {
+        // twiPollTransfer() keeps track of its own time
+        g_ctx.stallTicks = 0;
+        return;
+    }
+
+    if (g_ctx.twiSending && g_ctx.txWait != 0xffff)
+    {
+        g_ctx.txWait++;
+    }
+
+    if (g_ctx.txBackoff)
+    {
+        // Waiting to re-send, bus is idle as far as we are concerned.
+        // With a TWI interrupt pending (addressed as slave while in
+        // this ISR) leave TWCR alone, ISR_Twi sends START once done
+        g_ctx.txBackoff--;
+        if (g_ctx.txBackoff == 0 && g_ctx.twiSending &&
+            !g_ctx.twiReceiving && !g_ctx.twiSlaveTx &&
+            !(TWCR & b2m(TWCR_BIT_TWINT)))
+        {
+            TWCR = TWCR_ACT_START;
+        }
+        g_ctx.stallTicks = 0;
+        return;
+    }
+
+    if (!g_ctx.twiSending && !g_ctx.twiReceiving && !g_ctx.twiSlaveTx)
+    {
+        // Idle
+        g_ctx.stallTicks = 0;
+        return;
+    }
+
+    // In a transaction (or waiting for the bus to start one),
+    // ISR_Twi clears stallTicks each time it runs
+    g_ctx.stallTicks++;
+    if (g_ctx.stallTicks < TWI_STALL_TIMEOUT)
+    {
+        return;
+    }
+
+    g_ctx.stallTicks = 0;
+    if (twiBusMoving())
+    {
+        // Not stuck, another master's transfer is taking long (e.g. a
+        // 255 bytes twiSendSg() packet takes 23ms at 100KHz), and 
+        // we are waiting for its STOP to get the bus
+        return;
+    }
+    g_stats.busRecoveries++;
+    twiBusClear();
+
+    // Anything being received is lost (never published)
+    g_ctx.twiReceiving = false;
+    g_ctx.twiSlaveTx = false;
+    if (g_ctx.twiSending)
+    {
+        twiTxRetry(TWCR_MASK_READY);
+    }
+}
+
+// Get a copy of the driver statistics
+// May be called from loop() or an ISR
+void twiGetStats(twiStats_t *stats)
+{
+    uint8_t sreg = SREG;
+
+    // Counters are updated from ISRs and are more than 8 bits
+    TWI_CLI();
+    memcpy((void *)stats, (const void *)&g_stats, sizeof(twiStats_t));
+    SREG = sreg;
+}
+
+// Polled transfers, CPU cycles left before timing out, and 
+// (approximate) cycles per iteration of twiPollWait()
+static uint32_t g_pollSpins;
+#define TWI_POLL_SPINS_MS   (F_CPU / 1000UL / 10)
+
+// Wait for the current polled step to be done
+// Return its TWI state (see TWI_ST()), or 0xff on timeout
+static uint8_t twiPollWait(void)
+{
+    while (!(TWCR & b2m(TWCR_BIT_TWINT)))
+    {
+        if (--g_pollSpins == 0)
+        {
+            return 0xff;
+        }
+    }
+
+    return TWSR >> 3;
+}
+
+// Send START (or repeated START) and SLA+R/W
+// Return true if the slave ACKed it
+static bool twiPollAddress(uint8_t sla)
+{
+    uint8_t state;
+
+    TWCR = TWCR_POLL_START;
+    state = twiPollWait();
+    if (state != TWI_ST(0x08) && state != TWI_ST(0x10))
+    {
+        return false;
+    }
+
+    TWDR = sla;
+    TWCR = TWCR_POLL_ACK;
+    state = twiPollWait();
+    if (state == TWI_ST(0x18) || state == TWI_ST(0x40))
+    {
+        return true;
+    }
+    if (state == TWI_ST(0x20) || state == TWI_ST(0x48))
+    {
+        g_stats.addrNacks++;
+    }
+
+    return false;
+}
+
+// Another master addressed us while polling, instead of our
+// transfer going on (see TWCR_POLL_START)
+static inline bool twiPollAddressed(uint8_t state)
+{
+    return state == TWI_ST(0x60) || state == TWI_ST(0x68) ||
+           state == TWI_ST(0x70) || state == TWI_ST(0x78) ||
+           state == TWI_ST(0xa8) || state == TWI_ST(0xb0);
+}
+
+// ISR_Twi is not running (TWIE cleared), so the counters it 
+// updates can be updated here without a critical section
+bool twiPollTransfer(uint8_t toAddr, const uint8_t *wrData, uint16_t wrLen,
+                     uint8_t *rdData, uint16_t rdLen, uint16_t timeoutMs)
+{
+    uint8_t sreg = SREG;
+    uint8_t state = 0;
+    uint8_t sla = (toAddr & 0x7f) << 1;
+    uint16_t i;
+    bool done = false;
+    bool addressed = false;
+
+    if (wrLen == 0 && rdLen == 0)
+    {
+        return false;
+    }
+
+    // Take over TWI, only if ISR_Twi has nothing going on
+    // (including a TWI interrupt not yet served)
+    TWI_CLI();
+    if (g_ctx.twiSending || g_ctx.twiReceiving || g_ctx.twiSlaveTx || 
+        g_ctx.twiPolling || (TWCR & b2m(TWCR_BIT_TWINT)))
+    {
+        SREG = sreg;
+        return false;
+    }
+    g_ctx.twiPolling = true;
+    TWCR = b2m(TWCR_BIT_TWEN) | b2m(TWCR_BIT_TWEA);
+    SREG = sreg;
+
+    g_pollSpins = (uint32_t)timeoutMs * TWI_POLL_SPINS_MS + 1;
+
+    do
+    {
+        if (wrLen)
         {
-            // Kick off sending if not already receiving
-            SerialPrLn(("Kick off sender"));
-            TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTA);
+            if (!twiPollAddress(sla))
+            {
+                break;
+            }
+            for (i = 0; i < wrLen; i++)
+            {
+                TWDR = wrData[i];
+                TWCR = TWCR_POLL_NACK;
+                state = twiPollWait();
+                if (state != TWI_ST(0x28))
+                {
+                    break;
+                }
+            }
+            if (i < wrLen)
+            {
+                if (state == TWI_ST(0x30))
+                {
+                    g_stats.dataNacks++;
+                }
+                break;
+            }
+        }
+
+        if (rdLen)
+        {
+            if (!twiPollAddress(sla | b2m(SLA_RW_BIT_RD)))
+            {
+                break;
+            }
+            // ACK all but the last byte
+            for (i = 0; i < rdLen; i++)
+            {
+                TWCR = (i + 1 < rdLen) ? TWCR_POLL_ACK : TWCR_POLL_NACK;
+                state = twiPollWait();
+                if (state != TWI_ST(0x50) && state != TWI_ST(0x58))
+                {
+                    break;
+                }
+                rdData[i] = TWDR;
+            }
+            if (i < rdLen)
+            {
+                break;
+            }
+        }
+
+        done = true;
+        g_stats.txFrames++;
+    } while (false);
+
+    state = (TWCR & b2m(TWCR_BIT_TWINT)) ? (TWSR >> 3) : 0xff;
+    if (state == 0xff)
+    {
+        // Timed out, the bus may be stuck
+        g_stats.busRecoveries++;
+        twiBusClear();
+    }
+    else if (state == TWI_ST(0x38))
+    {
+        // Arbitration lost, just let go of the bus
+        g_stats.arbLosses++;
+        TWCR = TWCR_POLL_NACK;
+    }
+    else if (twiPollAddressed(state))
+    {
+        // The other master is waiting for us (SCL held low), leave
+        // TWINT set, ISR_Twi serves it once back to interrupt mode
+        // (and counts the arbitration lost, if so)
+        addressed = true;
+    }
+    else
+    {
+        TWCR = TWCR_POLL_STOP;
+        g_pollSpins = TWI_POLL_SPINS_MS;
+        while ((TWCR & b2m(TWCR_BIT_TWSTO)) && --g_pollSpins)
+        {
+        }
+    }
+
+    // Back to interrupt mode, sending whatever was queued meanwhile
+    // (if addressed, TWINT is not written so it stays set, ISR_Twi 
+    // sends START once done, if holding off twiTick() does)
+    TWI_CLI();
+    g_ctx.twiPolling = false;
+    if (addressed || !g_ctx.twiSending || g_ctx.txBackoff)
+    {
+        TWCR = TWCR_MASK_READY;
+    }
+    else
+    {
+        TWCR = TWCR_ACT_START;
+    }
+    SREG = sreg;
+
+    return done;
+}
+
+// Master Receiver, ACK the next byte only if more are expected
+// ONLY CALLED FROM ISR_Twi
+static void twiTxReadNext(volatile twiTxBuf_t *txBuf)
+{
+    if ((uint8_t)(txBuf->rdLen - txBuf->size) > 1)
+    {
+        TWCR = TWCR_ACT_ACK;
+    }
+    else
+    {
+        TWCR = TWCR_ACT_NACK;
+    }
+}
+
+// Slave Transmitter, load next byte of the reply
+// ONLY CALLED FROM ISR_Twi
+static void twiSlaveTxByte(void)
+{
+    uint8_t idx = g_ctx.slaveTxIdx;
+
+    // If the master reads past our reply, give it 0xff
+    TWDR = (idx < g_ctx.slaveTxLen) ? g_slaveTx[idx] : 0xff;
+    idx++;
+    g_ctx.slaveTxIdx = idx;
+    if (idx < g_ctx.slaveTxLen)
+    {
+        // More data, expect ACK
+        TWCR = TWCR_ACT_ACK;
+    }
+    else
+    {
+        // Last byte, expect NACK (0xc0), TWEA is set
+        // back once done (0xc0/0xc8)
+        TWCR = TWCR_ACT_NACK;
+    }
+}
+
+// Set the data returned when a master reads from us
+// ONLY CALLED FROM WITHIN AN ISR
+bool twiSetReply(const uint8_t *data, uint8_t len)
+{
+    if (len > sizeof(g_slaveTx))
+    {
+        return false;
+    }
+
+    memcpy((void *)g_slaveTx, (const void *)data, len);
+    g_ctx.slaveTxLen = len;
+
+    return true;
+}
+
+// Get the next free slot of the send queue to be filled in place
+// ONLY CALLED FROM WITHIN AN ISR
+twiTxBuf_t *twiTxAcquire(void)
+{
+    volatile twiTxBuf_t *txBuf;
+
+    if (g_ctx.txCount >= TWI_TX_QUEUE_DEPTH)
+    {
+        return NULL;
+    }
+
+    txBuf = &g_txQueue[(g_ctx.txHead + g_ctx.txCount) % TWI_TX_QUEUE_DEPTH];
+    // Most packets are write only, from buffer
+    txBuf->rdLen = 0;
+    txBuf->status = 0;
+
+    return (twiTxBuf_t *)txBuf;
+}
+
+// Queue the slot obtained with twiTxAcquire(), flagged with 
+// status (TWI_TX_Segments only from twiSendSg(), whatever the 
+// caller left in the slot's status is ignored)
+// ONLY CALLED FROM WITHIN AN ISR
+static bool twiTxQueue(twiTxBuf_t *sendBuf, uint8_t status)
+{
+    bool queued = false;
+
+    if (sendBuf != NULL && g_ctx.txCount < TWI_TX_QUEUE_DEPTH &&
+        sendBuf == &g_txQueue[(g_ctx.txHead + g_ctx.txCount) % TWI_TX_QUEUE_DEPTH] &&
+        (sendBuf->len <= sizeof(sendBuf->buffer) || 
+         (status & TWI_TX_Segments)) && 
+        sendBuf->rdLen <= TWI_MAX_BUF &&
+        (sendBuf->len > 0 || sendBuf->rdLen > 0) &&
+        (sendBuf->toAddr != TWI_GC_ADDRESS || sendBuf->rdLen == 0))
+    {
+        // Note toAddr 0 (General Call address) is allowed,
+        // as long as we only write to it
+        sendBuf->size = 0;
+        sendBuf->status = TWI_TX_Sending | status;
+        g_ctx.txCount++;
+        queued = true;
+
+        // If a packet is already being sent, the ISR will chain
+        // this one right after it. Same if a TWI interrupt is
+        // pending (e.g. just addressed as slave, called from another
+        // ISR), writing TWCR would clear TWINT before ISR_Twi serves
+        // it, ISR_Twi sends START once done with it. While holding
+        // off (see twiTxEnd()) twiTick() sends START once it is over
+        if (!g_ctx.twiSending && !g_ctx.twiReceiving && !g_ctx.twiSlaveTx &&
+            !g_ctx.twiPolling && !g_ctx.txBackoff &&
+            !(TWCR & b2m(TWCR_BIT_TWINT)))
+        {
+            // Kick off sending if not already addressed as slave
+            TWCR = TWCR_ACT_START;
 
             // NOTE while testing TX only, Uno was ending at state 0x20
             // with the STOP bit still set, and unable to send again, 
@@ -107,251 +875,431 @@ bool twiSend(twiTxBuf_t* sendBuf)
             // the other end hanging free (i.e. not connected), and once 
             // I removed the wires, it began to behave as expected.
         }
+        g_ctx.twiSending = true;
     }
     
-    return started;
+    return queued;
 }
 
-// TWI
-void ISR_Twi(void)
+// Queue for sending the slot obtained with twiTxAcquire()
+// ONLY CALLED FROM WITHIN AN ISR
+bool twiTxCommit(twiTxBuf_t *sendBuf)
+{
+    return twiTxQueue(sendBuf, 0);
+}
+
+// Send data
+// ONLY CALLED FROM WITHIN AN ISR
+bool twiSend(twiTxBuf_t* sendBuf)
+{
+    twiTxBuf_t *txBuf;
+
+    if (sendBuf->len > sizeof(sendBuf->buffer) || 
+        (txBuf = twiTxAcquire()) == NULL)
+    {
+        return false;
+    }
+
+    // Only what the caller fills, size/status are the driver's.
+    // Write only, rdLen is left 0 (see twiSend())
+    txBuf->toAddr = sendBuf->toAddr;
+    txBuf->len = sendBuf->len;
+    memcpy(txBuf->buffer, sendBuf->buffer, sendBuf->len);
+
+    return twiTxQueue(txBuf, 0);
+}
+
+// Queue a packet sent from segments
+// ONLY CALLED FROM WITHIN AN ISR
+bool twiSendSg(uint8_t toAddr, const twiSeg_t *segs, uint8_t nsegs)
+{
+    twiTxBuf_t *txBuf;
+    volatile twiSeg_t *txSegs;
+    uint16_t len = 0;
+    uint8_t i;
+
+    if (nsegs == 0 || nsegs > TWI_TX_MAX_SEGS || 
+        (txBuf = twiTxAcquire()) == NULL)
+    {
+        return false;
+    }
+
+    txSegs = g_txSegs[txBuf - (twiTxBuf_t *)g_txQueue];
+    for (i = 0; i < nsegs; i++)
+    {
+        txSegs[i].data = segs[i].data;
+        txSegs[i].len = segs[i].len;
+        txSegs[i].flash = segs[i].flash;
+        len += segs[i].len;
+    }
+    if (len > 255)
+    {
+        return false;
+    }
+
+    txBuf->toAddr = toAddr;
+    txBuf->len = (uint8_t)len;
+
+    return twiTxQueue(txBuf, TWI_TX_Segments);
+}
+
+// May be called from loop() or an ISR
+uint8_t twiTxPending(void)
+{
+    return g_ctx.txCount;
+}
+
+// May be called from loop() or an ISR
+bool twiBusy(void)
+{
+    return g_ctx.txCount != 0 || g_ctx.twiReceiving || 
+           g_ctx.twiSlaveTx || g_ctx.twiPolling;
+}
+
+// Byte idx of the packet at the head of the send queue,
+// sent from segments. idx is less than the packet length, 
+// so it is always within a segment (empty ones are skipped)
+// ONLY CALLED FROM ISR_Twi
+static inline uint8_t twiTxSegByte(uint8_t idx)
+{
+    volatile twiSeg_t *seg = g_txSegs[g_ctx.txHead];
+
+    while (idx >= seg->len)
+    {
+        idx -= seg->len;
+        seg++;
+    }
+
+    return seg->flash ? pgm_read_byte(seg->data + idx) : seg->data[idx];
+}
+
+// TWI state machine, state is TWSR >> 3 (see TWI_ST())
+static inline __attribute__ ((always_inline)) void twiDispatch(uint8_t state)
 {
     uint8_t data;
+    uint8_t idx;
+    volatile twiRxBuf_t *rxBuf;
+    volatile twiTxBuf_t *txBuf;
+
+    // Hot path (Slave Receiver), data received in the middle of
+    // a packet, nothing to decide but where to store it
+    if (state == TWI_ST(0x80) && g_ctx.twiReceiving && !g_ctx.rxDiscard)
+    {
+        rxBuf = &g_rxRing[g_rxHead & TWI_RX_QUEUE_MASK];
+        idx = rxBuf->size;
+        if (idx < TWI_MAX_BUF)
+        {
+            rxBuf->buffer[idx] = TWDR;
+            TWCR = TWCR_ACT_ACK;
+            rxBuf->size = idx + 1;
+            return;
+        }
+    }
+
+    // Packet at the head of the send queue
+    txBuf = &g_txQueue[g_ctx.txHead];
+
+    // Hot path (Master Transmitter), SLA+W or data was sent
+    // and there is more data to send
+    if ((state == TWI_ST(0x28) || state == TWI_ST(0x18)) && g_ctx.twiSending)
+    {
+        idx = txBuf->size;
+        if (idx < txBuf->len)
+        {
+            TWDR = (txBuf->status & TWI_TX_Segments) ? 
+                   twiTxSegByte(idx) : txBuf->buffer[idx];
+            TWCR = TWCR_ACT_ACK;
+            txBuf->size = idx + 1;
+            g_ctx.txRetry = 0;
+            return;
+        }
+    }
+
     // Note the different states purposely left with its hex value
     // to match the Data Sheet documentation in section:
     // "2-Wire Serial Interface" / "Transmission Modes"
-    volatile uint8_t twsr = TWSR & 0xf8; // Keep only the status bits
-
-    switch(twsr)
+    switch(state)
     {
         // +++++++++++++++++++
         // Receiving states
         // Slave Receiver mode
         // -------------------
-        case 0x60:
-            // Own SLA+W has been received
-            TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
+        case TWI_ST(0x60):
+            // Own SLA+W has been received,
+            // TWDR holds it (which one if using TWAMR)
+            data = TWDR;
             g_ctx.twiReceiving = true;
-            SerialPrLn2(("* 0x60 Own SLA+W has been received"));
+            twiRxBegin(TWI_RX_Receiving, data >> 1);
+            TWCR = twiRxAddressed();
             break;
-        case 0x68:
+        case TWI_ST(0x68):
             // Arbitration lost in SLA+R/W (owm address)
-            TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
+            data = TWDR;
+            g_stats.arbLosses++;
             g_ctx.twiReceiving = true;
-            SerialPrLn(("! 0x68 Arbitration lost in SLA+R/W"));
+            twiRxBegin(TWI_RX_Receiving, data >> 1);
+            TWCR = twiRxAddressed();
             break;
-        case 0x70:
-            // General call address received
-            TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
+        case TWI_ST(0x70):
+            // General call address received, always ACKed: other
+            // receivers ACK it anyway, our NACK would go unnoticed
             g_ctx.twiReceiving = true;
-            SerialPrLn2(("* 0x70 General call address received"));
+            twiRxBegin(TWI_RX_Receiving | TWI_RX_DataFromGC, TWI_GC_ADDRESS);
+            TWCR = TWCR_ACT_ACK;
             break;
-        case 0x78:
-            // Arbitration lost in SLA+R/W (GC address)
-            TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
+        case TWI_ST(0x78):
+            // Arbitration lost in SLA+R/W (GC address), as 0x70
+            g_stats.arbLosses++;
             g_ctx.twiReceiving = true;
-            SerialPrLn(("! 0x78 Arbitration lost in SLA+R/W (GC)"));
+            twiRxBegin(TWI_RX_Receiving | TWI_RX_DataFromGC, TWI_GC_ADDRESS);
+            TWCR = TWCR_ACT_ACK;
             break;
-        case 0x80:
-        case 0x88:
-            // Data received
-            data = TWDR;
-            TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
-            SerialPrLn2(("* 0x80 Data received"));
-            if (!g_ctx.twiReceiving)
-            {
-                SerialPrLn(("! 0x80 Unexpected data"));
-                g_ctx.twiReceiving = true;
-            }
-            if (g_rxBuf.status & TWI_RX_RecvCompleted)
-            {
-                // We had completed data already, discard it
-                SerialPrLn(("! 0x80 Previous packet being lost"));
-                g_rxBuf.status = TWI_RX_Receiving;
-                g_rxBuf.size = 0;
-            }
-            if (g_rxBuf.size < TWI_MAX_BUF)
+        case TWI_ST(0x88):
+        case TWI_ST(0x98):
+            // Data received, NACK returned (no room for the packet,
+            // see twiRxAddressed()). We are no longer addressed, 
+            // STOP will not be seen, the packet is never published.
+            // A packet of ours may have been queued meanwhile (or
+            // lost arbitration to this one, 0x68/0x78), START is sent
+            // once the bus is free
+            g_ctx.twiReceiving = false;
+            if (g_ctx.twiSending && !g_ctx.txBackoff)
             {
-                g_rxBuf.buffer[g_rxBuf.size] = data;
-                g_rxBuf.size++;
+                TWCR = TWCR_ACT_START;
             }
             else
             {
-                // Overflow
-                g_rxBuf.status |= TWI_RX_DataOverflow;
+                TWCR = TWCR_ACT_ACK;
             }
             break;
-        case 0x90:
-        case 0x98:
-            // Data received (GC)
+        case TWI_ST(0x80):
+            // Data received
             data = TWDR;
-            TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
-            SerialPrLn2(("* 0x90 Data received (GC)"));
+            TWCR = TWCR_ACT_ACK;
             if (!g_ctx.twiReceiving)
             {
-                SerialPrLn(("! 0x90 Unexpected data"));
+                g_stats.unexpected++;
                 g_ctx.twiReceiving = true;
+                twiRxBegin(TWI_RX_Receiving, g_ctx.slaveAddr);
             }
-            if (g_rxBuf.status & TWI_RX_RecvCompleted)
+            twiRxData(data);
+            break;
+        case TWI_ST(0x90):
+            // Data received (GC)
+            data = TWDR;
+            TWCR = TWCR_ACT_ACK;
+            if (!g_ctx.twiReceiving)
             {
-                // We had completed data already, discard it
-                SerialPrLn(("! 0x90 Previous packet being lost"));
-                g_rxBuf.status = TWI_RX_Receiving;
-                g_rxBuf.size = 0;
+                g_stats.unexpected++;
+                g_ctx.twiReceiving = true;
+                twiRxBegin(TWI_RX_Receiving | TWI_RX_DataFromGC, TWI_GC_ADDRESS);
             }
-            g_rxBuf.status |= TWI_RX_DataFromGC;
-            if (g_rxBuf.size < TWI_MAX_BUF)
+            twiRxData(data);
+            break;
+        case TWI_ST(0xa0):
+            // STOP has been received
+            if (g_ctx.twiReceiving)
             {
-                g_rxBuf.buffer[g_rxBuf.size] = data;
-                g_rxBuf.size++;
+                // Completed reception (STOP received),
+                // publish the packet to the consumer
+                twiRxPublish();
+                g_ctx.twiReceiving = false;
             }
             else
             {
-                // Overflow
-                g_rxBuf.status |= TWI_RX_DataOverflow;
-                SerialPrLn(("! 0x90 Data reception overflow"));
+                g_stats.unexpected++;
             }
-            break;
-        case 0xa0:
-            // STOP has been received
-            if (g_ctx.twiReceiving)
+            if (g_ctx.twiSending && !g_ctx.txBackoff)
             {
-                // Completed reception (STOP received)
-                g_rxBuf.status |= TWI_RX_RecvCompleted;
-                SerialPrLn2(("* 0xa0 Data reception complete"));
-                g_ctx.twiReceiving = false;
+                // We have data to send
+                TWCR = TWCR_ACT_START;
             }
             else
             {
-                SerialPrLn(("! 0xa0 Unexpected data"));
+                TWCR = TWCR_ACT_ACK;
             }
-            if (g_ctx.twiSending)
+            break;
+        // ++++++++++++++++++++++
+        // Sending states
+        // Slave Transmitter mode
+        // ----------------------
+        case TWI_ST(0xb0):
+            // Arbitration lost in SLA+R/W (own SLA+R received),
+            // our own packet (if any) is sent once we are done
+            g_stats.arbLosses++;
+            // Fall through
+        case TWI_ST(0xa8):
+            // Own SLA+R has been received
+            g_ctx.twiSlaveTx = true;
+            g_ctx.slaveTxIdx = 0;
+            twiSlaveTxByte();
+            break;
+        case TWI_ST(0xb8):
+            // Data was sent and ACK received
+            twiSlaveTxByte();
+            break;
+        case TWI_ST(0xc0):
+            // Data was sent and NACK received (master is done)
+        case TWI_ST(0xc8):
+            // Last data was sent and ACK received (master wanted more)
+            g_ctx.twiSlaveTx = false;
+            if (g_ctx.twiSending && !g_ctx.txBackoff)
             {
                 // We have data to send
-                TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTA);
-                SerialPrLn2(("* 0xa0 Receive completed, begin to send"));
+                TWCR = TWCR_ACT_START;
             }
             else
             {
-                TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
+                TWCR = TWCR_ACT_ACK;
             }
             break;
         // +++++++++++++++++++++++
         // Sending states
         // Master Transmitter mode
         // -----------------------
-        case 0x08:
-            SerialPrLn2(("* 0x08 Start was sent"));
+        case TWI_ST(0x08):
             // Note START must be manually cleared, which I do
             // by writting new value to TWCR without START bit set
             if (g_ctx.twiSending)
             {
-                // For a sender, flag R/W = 0
-                TWDR = ((g_txBuf.toAddr & 0x7f) << 1);
-                TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
+                // Packets with nothing to write go straight to reading,
+                // otherwise R/W = 0 and we read (if requested) after
+                // a repeated START
+                g_ctx.txReadPhase = (txBuf->len == 0);
+                TWDR = ((txBuf->toAddr & 0x7f) << 1) | 
+                       (g_ctx.txReadPhase ? b2m(SLA_RW_BIT_RD) : 0);
+                TWCR = TWCR_ACT_ACK;
+                txBuf->size = 0; // First data byte
                 g_ctx.txRetry = 0;
             }
             else
             {
-                SerialPrLn(("! 0x08 Start was sent but we are not sending"));
-                TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTO);
+                g_stats.unexpected++;
+                TWCR = TWCR_ACT_STOP;
             }
             break;
-        case 0x10:
-            SerialPrLn2(("* 0x10 Repeat start was sent"));
+        case TWI_ST(0x10):
             if (g_ctx.twiSending)
             {
-                // For a sender, flag R/W = 0
-                TWDR = ((g_txBuf.toAddr & 0x7f) << 1);
-                TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
+                // Either a retry (same R/W as before), 
+                // all data was written and now we read, or
+                // the next packet chained (see twiTxEnd())
+                TWDR = ((txBuf->toAddr & 0x7f) << 1) | 
+                       (g_ctx.txReadPhase ? b2m(SLA_RW_BIT_RD) : 0);
+                TWCR = TWCR_ACT_ACK;
+                txBuf->size = 0; // First data byte
             }
             else
             {
-                SerialPrLn(("! 0x10 Repeat start was sent but we are not sending"));
-                TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTO);
+                g_stats.unexpected++;
+                TWCR = TWCR_ACT_STOP;
             }
             break;
-        case 0x18:
-            SerialPrLn2(("* 0x18 SLA+W was sent"));
+        case TWI_ST(0x18):
+            // Sending the first data byte is handled by the hot path,
+            // we should have had data to send
+            g_stats.unexpected++;
+            TWCR = TWCR_ACT_STOP;
+            break;
+        case TWI_ST(0x20):
+            g_stats.addrNacks++;
+            twiTxAddrNack();
+            break;
+        case TWI_ST(0x28):
             if (g_ctx.twiSending)
             {
-                if (g_txBuf.len)
+                // Sending more data is handled by the hot path
+                if (txBuf->rdLen)
                 {
-                    g_txBuf.size = 0; // First data byte
-                    TWDR = g_txBuf.buffer[g_txBuf.size];
-                    TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
-                    g_txBuf.size++;
-                    g_ctx.txRetry = 0;
+                    // Have transmitted all data, now read the 
+                    // reply, repeated START keeps the bus
+                    g_ctx.txReadPhase = true;
+                    TWCR = TWCR_ACT_START;
                 }
                 else
                 {
-                    // We should have data to send
-                    SerialPrLn(("! 0x18 SLA+W was sent but don't have data to send"));
-                    TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTO);
+                    // Have transmitted all data
+                    txBuf->status |= TWI_TX_SendCompleted;
+                    g_stats.txFrames++;
+                    twiTxEnd();
                 }
             }
             else
             {
-                SerialPrLn(("! 0x18 SLA+W was sent but we are not sending"));
-                TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTO);
+                g_stats.unexpected++;
+                TWCR = TWCR_ACT_STOP;
             }
             break;
-        case 0x20:
-            SerialPrLn(("! 0x20 SLA+W was sent but did not get ACK"));
-            // Send a repeated START if allowed
-            if (g_ctx.txRetry < TWI_MAX_TX_RETRY)
-            {
-                TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTA);
-                g_ctx.txRetry++;
-            }
-            else
-            {
-                // Failed to send packet
-                TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTO);
-                g_ctx.twiSending = false;
-                SerialPr(("! 0x20 failed to send packet after retries, giving up, TWCR: 0x"));
-                SerialPrLn((TWCR, 16));
-            }
+        case TWI_ST(0x30):
+            g_stats.dataNacks++;
+            // Abort sending, send the whole packet again later
+            twiTxRetry(TWCR_ACT_STOP);
             break;
-        case 0x28:
-            SerialPrLn2(("* 0x28 Data was sent and ACK received"));
+        case TWI_ST(0x38):
+            // Also arbitration lost in NACK bit (Master Receiver)
+            twiTxArbLost();
+            break;
+        // ++++++++++++++++++++
+        // Receiving states
+        // Master Receiver mode
+        // --------------------
+        case TWI_ST(0x40):
             if (g_ctx.twiSending)
             {
-                if (g_txBuf.size < g_txBuf.len)
-                {
-                    TWDR = g_txBuf.buffer[g_txBuf.size];
-                    TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
-                    g_txBuf.size++;
-                }
-                else
-                {
-                    // Have transmitted all data, send STOP
-                    TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTO);
-                    // We can now accept another packet to send
-                    g_ctx.twiSending = false;
-                    g_txBuf.status |= TWI_TX_SendCompleted;
-                }
+                // Reply goes to the receive ring as any other packet
+                txBuf->size = 0; // Bytes read
+                twiRxBegin(TWI_RX_Receiving | TWI_RX_MasterRead, 
+                           txBuf->toAddr & 0x7f);
+                twiTxReadNext(txBuf);
+                g_ctx.txRetry = 0;
             }
             else
             {
-                SerialPrLn(("! 0x28 Data was sent but we are not sending"));
-                TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTO);
+                g_stats.unexpected++;
+                TWCR = TWCR_ACT_NACK;
             }
             break;
-        case 0x30:
-            SerialPrLn(("! 0x30 Data was sent but did not get ACK"));
-            // Abort sending, we retry only at the begining, 
-            // but data failure, fails the whole sending
-            // Failed to send packet
-            TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTO);
+        case TWI_ST(0x48):
+            g_stats.addrNacks++;
+            twiTxAddrNack();
+            break;
+        case TWI_ST(0x50):
+            // Data received, ACK returned
+            data = TWDR;
+            twiRxData(data);
+            txBuf->size++;
+            twiTxReadNext(txBuf);
             break;
-        case 0x38:
-            SerialPrLn(("! 0x38 Arbitration lost in SLA+W/Data, send START when bus is free"));
-            TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT) | b2m(TWCR_BIT_TWSTA);
+        case TWI_ST(0x58):
+            // Data received, NACK returned (last byte)
+            data = TWDR;
+            twiRxData(data);
+            twiRxPublish();
+            txBuf->status |= TWI_TX_SendCompleted;
+            g_stats.txFrames++;
+            twiTxEnd();
             break;
         default:
-            SerialPr(("! 0x"));
-            SerialPr((twsr, 16));
-            SerialPrLn((" Unexpected state"));
-            TWCR = TWCR_MASK_READY | b2m(TWCR_BIT_TWINT);
+            g_stats.unexpected++;
+            TWCR = TWCR_ACT_ACK;
     }
 }
+
+// TWI
+void ISR_Twi(void)
+{
+    // The bus is moving
+    g_ctx.stallTicks = 0;
+
+    twiDispatch(TWSR >> 3);
+
+    // TWCR has been written, the bus is not waiting for us
+    if (g_ctx.rxNotify)
+    {
+        g_ctx.rxNotify = false;
+        if (g_rxCallback != NULL)
+        {
+            g_rxCallback();
+        }
+    }
+}
\ No newline at end of file
@@ -1,62 +1,489 @@
 #ifndef __TWIAPI_H__
 #define __TWIAPI_H__
 
-// Maximum amount of data we can send/receive
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Maximum amount of data we can send/receive in a packet,
+// it sizes every slot of the send queue and of the receive ring
+#ifndef TWI_MAX_BUF
 #define TWI_MAX_BUF         8
+#endif
+
+static_assert(TWI_MAX_BUF > 0 && TWI_MAX_BUF <= 255,
+              "TWI_MAX_BUF must be between 1 and 255");
+
+// Number of packets that can be waiting to be sent,
+// including the one being sent
+#ifndef TWI_TX_QUEUE_DEPTH
+#define TWI_TX_QUEUE_DEPTH  4
+#endif
+
+// Number of received packets that can be held until
+// read with twiRecv(), must be a power of 2
+#ifndef TWI_RX_QUEUE_DEPTH
+#define TWI_RX_QUEUE_DEPTH  4
+#endif
+
+// What to do with a packet arriving while the receive ring is full
+// (the consumer is behind):
+// TWI_RX_DROP_NEWEST: Discard the packet arriving
+// TWI_RX_DROP_OLDEST: Discard the oldest packet in the ring, unless
+//                     the consumer holds it (twiRxPeek() without 
+//                     twiRxRelease() yet), then the one arriving
+// TWI_RX_NACK:        NACK its first data byte, the master sees 0x30
+//                     and sends it again later, nothing is lost
+//                     (unless the master runs out of attempts).
+//                     A reply read as master is dropped (counted in
+//                     rxDropped), the read itself succeeded. So is a
+//                     General Call packet, the other receivers ACK
+//                     it, the master would never see our NACK
+#define TWI_RX_DROP_NEWEST  0
+#define TWI_RX_DROP_OLDEST  1
+#define TWI_RX_NACK         2
+
+#ifndef TWI_RX_FULL_POLICY
+#define TWI_RX_FULL_POLICY  TWI_RX_NACK
+#endif
 
-// Buffer used to receive data
-typedef struct __twiRxBuf_t
+// Buffer used to receive data, N bytes of data
+template <uint8_t N>
+struct TwiRxBuffer
 {
-    // bytes received so far [1, TWI_MAX_BUF-1]
+    // bytes received so far [0, N]
     uint8_t size;
 
     // 0x01 : receiving (set on first data received)
     // 0x02 : finished receiving (STOP was received)
     // 0x04 : data overflow
     // 0x08 : data from general call
+    // 0x10 : data read from a slave (reply to twiTxBuf_t.rdLen)
     uint8_t status;
 
+    // Address the packet was sent to, one of ours (see twiInit() 
+    // addrMask) or TWI_GC_ADDRESS, or the slave it was read from 
+    // if TWI_RX_MasterRead
+    uint8_t addr;
+
     // Buffer where to store data received
-    uint8_t buffer[TWI_MAX_BUF];    
-} twiRxBuf_t;
+    uint8_t buffer[N];    
+};
+
+// Buffer used by the driver
+typedef TwiRxBuffer<TWI_MAX_BUF> twiRxBuf_t;
 
 #define TWI_RX_Receiving        0x01
 #define TWI_RX_RecvCompleted    0x02
 #define TWI_RX_DataOverflow     0x04
 #define TWI_RX_DataFromGC       0x08
+#define TWI_RX_MasterRead       0x10
 
-// Buffer used to send data
-typedef struct __twiTxBuf_t
+// Buffer used to send data, up to N bytes of data
+template <uint8_t N>
+struct TwiTxBuffer
 {
     // To address
     uint8_t toAddr;
 
-    // Number of bytes sent
+    // Number of bytes sent (or read once reading)
     uint8_t size;
 
     // 0x01 : sending
     // 0x02 : finished sending
+    // 0x04 : data comes from segments (see twiSendSg())
     uint8_t status;
 
     // Number of bytes to send
     uint8_t len; 
 
+    // Number of bytes to read from toAddr once sent, after a
+    // repeated START, 0 if only writing. If len is 0 we only read.
+    // Data read is received as a packet flagged TWI_RX_MasterRead
+    uint8_t rdLen;
+
     // Buffer from where to send data
-    uint8_t buffer[TWI_MAX_BUF];    
-} twiTxBuf_t;
+    uint8_t buffer[N];    
+};
+
+// Buffer used by the driver
+typedef TwiTxBuffer<TWI_MAX_BUF> twiTxBuf_t;
 
 #define TWI_TX_Sending          0x01
 #define TWI_TX_SendCompleted    0x02
+#define TWI_TX_Segments         0x04
+
+// Segment of a packet sent with twiSendSg()
+typedef struct __twiSeg_t
+{
+    // Data, in RAM or in flash (PROGMEM)
+    const uint8_t *data;
+    uint8_t len;
+    bool flash;
+} twiSeg_t;
+
+// Maximum number of segments in a packet sent with twiSendSg(),
+// every slot of the send queue has room for them
+#ifndef TWI_TX_MAX_SEGS
+#define TWI_TX_MAX_SEGS     2
+#endif
+
+// Ms without any TWI interrupt while in a transaction (or waiting 
+// to start one) before considering the bus stuck and clearing it,
+// unless SCL is still moving (another master is using the bus)
+#ifndef TWI_STALL_TIMEOUT
+#define TWI_STALL_TIMEOUT   10
+#endif
+
+// Attempts to send a packet (after a NACK or a stuck bus) before
+// giving up on it. Arbitration losses do not count, see
+// TWI_TX_MAX_ARB_LOSSES
+#ifndef TWI_TX_MAX_ATTEMPTS
+#define TWI_TX_MAX_ATTEMPTS 4
+#endif
+
+// Ms to wait before sending a packet again,
+// doubled on each following attempt
+#ifndef TWI_TX_BACKOFF
+#define TWI_TX_BACKOFF      2
+#endif
+
+// Random wait (ms) after losing arbitration is picked from a window
+// starting at TWI_ARB_WINDOW_MAX / 2, halved on each loss of the same
+// packet, down to TWI_ARB_WINDOW_MIN: packets that lost more often
+// come back sooner. Both must be powers of 2.
+#ifndef TWI_ARB_WINDOW_MIN
+#define TWI_ARB_WINDOW_MIN  2
+#endif
+
+#ifndef TWI_ARB_WINDOW_MAX
+#define TWI_ARB_WINDOW_MAX  32
+#endif
+
+// Arbitration losses of a packet before giving up on it
+#ifndef TWI_TX_MAX_ARB_LOSSES
+#define TWI_TX_MAX_ARB_LOSSES 64
+#endif
+
+// A packet sent at the first attempt, but only after waiting (a ms
+// or more) for other masters to free the bus, holds off the next
+// one for a random wait (ms) in this window, so masters addressing
+// lower addresses do not always win. Power of 2, 0 to never hold off
+#ifndef TWI_TX_HOLD_WINDOW
+#define TWI_TX_HOLD_WINDOW  8
+#endif
+
+// Packets sent back to back before letting other masters 
+// a chance to get the bus (random wait in TWI_ARB_WINDOW_MIN)
+#ifndef TWI_TX_BURST
+#define TWI_TX_BURST        4
+#endif
 
-// Initialize
-void twiInit(uint8_t slaveAddress);
+// Driver statistics (see twiGetStats()), updated by the ISRs 
+// instead of printing, so they cost a few cycles and can be read
+// at any time (in production too) to judge the link health.
+// Counters wrap around, use differences between snapshots
+typedef struct __twiStats_t
+{
+    // Packets sent (and read, if any) successfully as master
+    uint16_t txFrames;
+
+    // Packets received (as slave, or read as master) and published
+    uint16_t rxFrames;
+
+    // SLA+R/W not acknowledged (nobody at that address, or busy)
+    uint16_t addrNacks;
+
+    // Data byte not acknowledged by the slave
+    uint16_t dataNacks;
+
+    // Packets received with more than TWI_MAX_BUF bytes (truncated)
+    uint16_t rxOverflows;
+
+    // Packets received but dropped, the receive ring was full
+    // (see TWI_RX_FULL_POLICY, replies read as master and General
+    // Call packets are always dropped, they can not be refused)
+    uint16_t rxDropped;
+
+    // Packets refused (NACK), the receive ring was full
+    uint16_t rxNacked;
+
+    // States or events the driver did not expect
+    uint16_t unexpected;
+
+    // Times the bus was found stuck and cleared
+    uint16_t busRecoveries;
+
+    // Packets sent again after a failed attempt
+    uint16_t txRetries;
+
+    // Packets given up on after TWI_TX_MAX_ATTEMPTS attempts
+    // or TWI_TX_MAX_ARB_LOSSES arbitration losses
+    uint16_t txFailures;
+
+    // Times arbitration was lost to another master
+    uint16_t arbLosses;
+
+    // Longest time (ms) a packet waited at the head of the send 
+    // queue until sent (or given up on)
+    uint16_t txMaxWait;
+} twiStats_t;
+
+// SCL frequencies (Hz)
+#define TWI_SCL_STANDARD    100000UL    // Standard-mode
+#define TWI_SCL_FAST        400000UL    // Fast-mode
+
+// SCL frequency used by twiInit() unless given explicitly
+#ifndef TWI_SCL_FREQ
+#define TWI_SCL_FREQ        TWI_SCL_STANDARD
+#endif
+
+// How much lower than requested (%) the actual SCL frequency may be
+#ifndef TWI_SCL_TOLERANCE
+#define TWI_SCL_TOLERANCE   5
+#endif
+
+// Bit rate generator settings, calculated at compile time
+//
+// This is the devisor as defined in data sheet
+// "Bit Rate Generator Unit"
+//
+// SCL frequency = CPU clock frequency / { 16 + [ 2 * TWBR * 4^TWPS ] }
+// or
+// TWBR = { [ CPU clock frequency / SCL frequency] - 16 } / { 2 * 4^TPWS }
+//
+// TWBR is rounded up, so SCL is never faster than requested, and
+// the smallest TWPS (pre-scaler 1, 4, 16 or 64) with TWBR fitting
+// in 8 bits is used.
+//
+// At 16MHz these are ranges for all TWPS values:
+// TWPS = 0: SCL freqs. [31, 888] KHz, TWBR [250, 1]
+// TWPS = 1: SCL freqs. [ 8, 666] KHz, TWBR [248, 1]
+// TWPS = 2: SCL freqs. [ 2, 333] KHz, TWBR [250, 1]
+// TWPS = 3: SCL freqs. [ .5,111] KHz, TWBR [250, 1]
+constexpr unsigned long twiCalcTwbr(unsigned long sclFreq, uint8_t twps)
+{
+    return (F_CPU - 16 * sclFreq + (2UL << (2 * twps)) * sclFreq - 1) /
+           ((2UL << (2 * twps)) * sclFreq);
+}
+
+constexpr uint8_t twiCalcTwps(unsigned long sclFreq, uint8_t twps = 0)
+{
+    return (twps >= 3 || twiCalcTwbr(sclFreq, twps) <= 255) ? 
+           twps : twiCalcTwps(sclFreq, twps + 1);
+}
 
-// Query and receive
+constexpr unsigned long twiCalcScl(unsigned long twbr, uint8_t twps)
+{
+    return F_CPU / (16 + (twbr << (1 + 2 * twps)));
+}
+
+template <unsigned long SCLFreq>
+struct TwiBitRate
+{
+    static_assert(SCLFreq > 0 && 16 * SCLFreq < F_CPU,
+                  "SCL frequency too high for F_CPU");
+
+    static constexpr uint8_t twps = twiCalcTwps(SCLFreq);
+
+    static_assert(twiCalcTwbr(SCLFreq, twps) <= 255,
+                  "SCL frequency too low for F_CPU");
+
+    static constexpr uint8_t twbr = (uint8_t)twiCalcTwbr(SCLFreq, twps);
+
+    // SCL frequency we actually get
+    static constexpr unsigned long sclFreq = twiCalcScl(twbr, twps);
+
+    static_assert(sclFreq * 100 >= SCLFreq * (100 - TWI_SCL_TOLERANCE),
+                  "SCL frequency can not be set within TWI_SCL_TOLERANCE");
+};
+
+// General Call address, a packet sent to it is received in one 
+// transaction by every node initialized with TWI_INIT_GENERAL_CALL
+// (flagged TWI_RX_DataFromGC). Write only, it can not be read from
+#define TWI_GC_ADDRESS          0
+
+// twiInit() options
+#define TWI_INIT_GENERAL_CALL   0x01    // Receive General Call packets
+
+// Called from ISR_Twi as soon as a packet has been received
+// (STOP received, or last byte read as master), after the bus has
+// been released. When given, it is the receive ring consumer, it
+// uses twiRxPeek()/twiRxRelease() (or twiRecv()) as any other.
+//
+// It runs inside ISR_Twi with interrupts disabled, its execution 
+// budget is TWI_RX_CALLBACK_US, half a byte time at TWI_SCL_FREQ 
+// (45us at Standard-mode, 11us at Fast-mode), so the next packet 
+// addressed to us is not held back (SCL stretched) for long, and it
+// does not make 1ms timer interrupts (e.g. twiTick()) late. Anything
+// longer must be deferred (e.g. flag it and do it from loop()).
+// Going over only slows the bus down to our pace, nothing is lost:
+// a 45us callback run at Fast-mode stretches SCL by 2 byte times.
+typedef void (*twiRxCallback_t)(void);
+
+// Receive callback budget (us), half a byte (9 bits) time
+#define TWI_RX_CALLBACK_US  (9 * 1000000UL / 2 / TWI_SCL_FREQ)
+
+// Initialize with the given bit rate generator settings,
+// use twiInit() instead
+void twiInitRate(uint8_t slaveAddress, uint8_t options, uint8_t addrMask,
+                 twiRxCallback_t rxCallback, uint8_t twbr, uint8_t twps);
+
+// Initialize, SCL frequency (Hz) checked and converted at compile time
+// e.g. twiInit(addr) or twiInit<TWI_SCL_FAST>(addr, TWI_INIT_GENERAL_CALL)
+//
+// Address bits set in addrMask (7 bits, TWAMR) are ignored when 
+// matching our slave address, so we answer a block of addresses, 
+// e.g. slaveAddress 0x60 and addrMask 0x03 answers 0x60 to 0x63. 
+// The address matched is given in each packet received (addr), 
+// so each one can be used as a different endpoint.
+//
+// rxCallback (optional) see twiRxCallback_t, without it packets
+// received are only polled for (twiRecv(), twiRxPeek())
+template <unsigned long SCLFreq = TWI_SCL_FREQ>
+inline void twiInit(uint8_t slaveAddress, uint8_t options = 0, 
+                    uint8_t addrMask = 0, twiRxCallback_t rxCallback = NULL)
+{
+    twiInitRate(slaveAddress, options, addrMask, rxCallback,
+                TwiBitRate<SCLFreq>::twbr, TwiBitRate<SCLFreq>::twps);
+}
+
+// Query and receive the oldest packet received
 // Return true if we have received data
 bool twiRecv(twiRxBuf_t *recvBuf);
 
-// Start a send
-// Return true if succeeded in starting the send
+// Must be called every 1ms (e.g. from a timer ISR), it detects
+// a stuck bus and paces the re-sending of packets
+void twiTick(void);
+
+// Get a copy of the driver statistics
+void twiGetStats(twiStats_t *stats);
+
+// Polled (blocking) transfer as master, for bulk one-off transfers
+// (e.g. a table sent at boot), much faster than byte by byte through
+// ISR_Twi. Writes wrLen bytes to toAddr and then, if rdLen is not 0,
+// reads rdLen bytes after a repeated START (wrLen 0 only reads).
+// Lengths are not limited by TWI_MAX_BUF, nothing is buffered.
+//
+// Only called from loop() (or setup(), interrupts need not be on),
+// once the driver is idle: the send queue must be empty.
+// ISR_Twi is not used while it lasts, packets queued meanwhile are
+// sent afterwards. If another master addresses us before we get the
+// bus, or wins arbitration over us with our address, the transfer
+// fails and ISR_Twi then serves that master as usual.
+//
+// timeoutMs bounds the whole transfer (approximately, CPU cycles 
+// are counted), on timeout the bus is cleared.
+// Return false if the driver is busy, the slave did not ACK, 
+// arbitration was lost, another master addressed us or on timeout
+bool twiPollTransfer(uint8_t toAddr, const uint8_t *wrData, uint16_t wrLen,
+                     uint8_t *rdData, uint16_t rdLen, uint16_t timeoutMs);
+
+// Set the data returned when a master reads from us,
+// it is returned on every read until set again
+// Return false if len is greater than TWI_MAX_BUF
+bool twiSetReply(const uint8_t *data, uint8_t len);
+
+// Queue a packet to be sent, kick off the send if idle
+// Only toAddr, len and buffer are used, the packet is write only:
+// its rdLen is ignored (callers need not set it), to read use 
+// twiTxAcquire()/twiTxCommit()
+// Return true if succeeded in queueing the packet,
+// false if the send queue is full
 bool twiSend(twiTxBuf_t *sendBuf);
 
+//
+// Zero-copy API
+//
+// Packets are filled/read in place, in the driver's own buffers.
+// twiSend() and twiRecv() are just a copy on top of these.
+//
+
+// Same as twiSend()/twiRecv() but for buffers of other sizes,
+// e.g. a TwiTxBuffer<1> for 1 byte control packets.
+// Data received that does not fit in recvBuf is dropped and
+// recvBuf flagged with TWI_RX_DataOverflow
+template <uint8_t N>
+inline bool twiSend(const TwiTxBuffer<N> *sendBuf);
+
+template <uint8_t N>
+inline bool twiRecv(TwiRxBuffer<N> *recvBuf);
+
+// Queue a packet made of nsegs segments (e.g. a constant header
+// in flash and a payload), sent one after the other straight from 
+// where they are, without being copied into the send queue.
+// Segments are copied, their data is not: it must stay unchanged
+// until sent (see twiTxPending()). The packet may be longer than 
+// TWI_MAX_BUF, up to 255 bytes.
+// Return false if the send queue is full or the packet is invalid
+bool twiSendSg(uint8_t toAddr, const twiSeg_t *segs, uint8_t nsegs);
+
+// Number of packets in the send queue, including the one being sent
+uint8_t twiTxPending(void);
+
+// Return true while TWI has a transaction in progress or 
+// packets waiting to be sent, i.e. TWI must keep its clock 
+// (see adcSleep())
+bool twiBusy(void);
+
+// Get the slot where to build the next packet to send
+// (fill toAddr, len and buffer, and rdLen if reading, it is set to 0)
+// Return NULL if the send queue is full
+twiTxBuf_t *twiTxAcquire(void);
+
+// Queue for sending the slot obtained with twiTxAcquire()
+// Return false if the packet is invalid (e.g. len out of range),
+// the slot is then left free for the next twiTxAcquire()
+bool twiTxCommit(twiTxBuf_t *sendBuf);
+
+// Get the oldest packet received, without removing it
+// Return NULL if we have not received data
+const twiRxBuf_t *twiRxPeek(void);
+
+// Remove the packet obtained with twiRxPeek(), its
+// buffer must not be used after this call
+void twiRxRelease(void);
+
+template <uint8_t N>
+inline bool twiSend(const TwiTxBuffer<N> *sendBuf)
+{
+    static_assert(N <= TWI_MAX_BUF, "Buffer bigger than TWI_MAX_BUF");
+    twiTxBuf_t *txBuf;
+
+    if (sendBuf->len > N || (txBuf = twiTxAcquire()) == NULL)
+    {
+        return false;
+    }
+
+    txBuf->toAddr = sendBuf->toAddr;
+    txBuf->len = sendBuf->len;
+    memcpy(txBuf->buffer, sendBuf->buffer, sendBuf->len);
+
+    return twiTxCommit(txBuf);
+}
+
+template <uint8_t N>
+inline bool twiRecv(TwiRxBuffer<N> *recvBuf)
+{
+    const twiRxBuf_t *rxBuf = twiRxPeek();
+
+    if (rxBuf == NULL)
+    {
+        return false;
+    }
+
+    recvBuf->status = rxBuf->status;
+    recvBuf->addr = rxBuf->addr;
+    recvBuf->size = rxBuf->size;
+    if (recvBuf->size > N)
+    {
+        recvBuf->size = N;
+        recvBuf->status |= TWI_RX_DataOverflow;
+    }
+    memcpy(recvBuf->buffer, rxBuf->buffer, recvBuf->size);
+    twiRxRelease();
+
+    return true;
+}
+
 #endif // __TWIAPI_H__
\ No newline at end of file
@@ -0,0 +1,55 @@
+#ifndef __TWIFRM_H__
+#define __TWIFRM_H__
+
+#include <stdint.h>
+
+#include <twiapi.h>
+
+//
+// Compact framing on top of the TWI API
+//
+// +--------+-----------------+-------+
+// | header | payload (n)     | CRC-8 |
+// +--------+-----------------+-------+
+//
+// header: bits 7:4 frame type, bits 3:0 sequence number 
+//         (incremented on each frame built, wraps around)
+// CRC-8:  over header and payload, polynomial x^8+x^2+x+1 (0x07),
+//         initial value 0, same as SMBus PEC
+//
+// Payload length is not sent, it is whatever is left
+// between the header and the CRC.
+//
+
+#define TWI_FRM_TYPE_MASK   0xf0
+#define TWI_FRM_SEQ_MASK    0x0f
+
+// Frame types
+#define TWI_FRM_POT         0x10    // Pot samples, 1 byte each, oldest first
+
+// Bytes added to the payload, and frame length for n bytes of payload
+#define TWI_FRM_OVERHEAD    2
+#define TWI_FRM_LEN(n)      ((n) + TWI_FRM_OVERHEAD)
+
+// Largest payload a frame can carry
+#define TWI_FRM_MAX_PAYLOAD (TWI_MAX_BUF - TWI_FRM_OVERHEAD)
+
+// CRC-8 of len bytes
+uint8_t twiCrc8(const uint8_t *data, uint8_t len);
+
+// Build a frame of type with len bytes of payload into frame,
+// which must have room for TWI_FRM_LEN(len) bytes
+// Return the frame length
+uint8_t twiFrmBuild(uint8_t *frame, uint8_t type, const uint8_t *data, uint8_t len);
+
+// Build a frame straight into the send queue and queue it
+// Return false if the send queue is full or the payload is too long
+bool twiFrmSend(uint8_t toAddr, uint8_t type, const uint8_t *data, uint8_t len);
+
+// Check a received packet is a valid frame
+// Return true if it is, and set its header, payload (which
+// points into recvBuf) and payload length
+bool twiFrmDecode(const twiRxBuf_t *recvBuf, uint8_t *header, 
+                  const uint8_t **payload, uint8_t *len);
+
+#endif // __TWIFRM_H__
\ No newline at end of file
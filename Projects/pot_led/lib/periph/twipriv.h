@@ -4,28 +4,85 @@
 #include <stdint.h>
 
 #include <undef.h>
+#if defined(TWI_HOST)
+// Host build, the TWI hardware is played by a bus model (see twihost.h)
+#include <twihost.h>
+#else
+#include <avr/pgmspace.h>
+#include <regs.h>
 #include <gpio.h>
+#include <timer.h>
+#endif
 
 typedef struct __twiContext_t
 {
     uint8_t slaveAddr;
     bool twiReceiving;
+    // Receive ring was full when the packet started,
+    // ignore its data
+    bool rxDiscard;
+    // A packet was published, call the receive callback
+    bool rxNotify;
 
     // Keep track of re-tries when sending,
     // i.e. we we don't get an ACK
     uint8_t txRetry;
     bool twiSending;
+    // Packet being sent has written all its data and
+    // is now reading (Master Receiver)
+    bool txReadPhase;
+
+    // Addressed by a master to read from us (Slave Transmitter),
+    // next byte of the reply to send and reply length
+    bool twiSlaveTx;
+    uint8_t slaveTxIdx;
+    uint8_t slaveTxLen;
+
+    // Send queue, packets are sent from txHead,
+    // txCount is the number of packets queued
+    uint8_t txHead;
+    uint8_t txCount;
+
+    // Attempts made to send the packet at the head of the queue,
+    // and ms to wait before the next one (0 when not waiting)
+    uint8_t txAttempts;
+    uint8_t txBackoff;
+
+    // Arbitration lost by the packet at the head of the queue,
+    // and ms it has been waiting at the head of the queue
+    uint8_t txArbLosses;
+    uint16_t txWait;
+
+    // Packets sent back to back, without letting go of the bus
+    uint8_t txBurst;
+
+    // Pseudo random number generator state
+    uint8_t rand;
+
+    // Ms in a transaction without any TWI interrupt
+    uint8_t stallTicks;
+
+    // A polled transfer (twiPollTransfer()) owns TWI, ISR_Twi 
+    // is not used and nothing else may start a transaction
+    bool twiPolling;
 } twiContext_t;
 
 #define TWI_MAX_TX_RETRY    1
 
-#if defined(__AVR_ATmega328P__)
+#if defined(TWI_HOST)
+
+// ISR_Twi is a plain function, called by the bus model, and
+// TWI_PORT/DDR/PIN, TWI_SCL/SDA_PULL_UP, SREG, TWI_CLI() and 
+// pgm_read_byte() come from twihost.h
+
+#elif defined(__AVR_ATmega328P__)
 
 #define ISR_Twi             __vector_ ## 24
 
 // SCL/SDA internal pull-up resistors
 #define TWI_PORT            PORTC
 #define TWI_DDR             DDRC
+#define TWI_PIN             PINC
 #define TWI_SCL_PULL_UP     5
 #define TWI_SDA_PULL_UP     4
 
@@ -36,6 +93,7 @@ typedef struct __twiContext_t
 // SCL/SDA internal pull-up resistors
 #define TWI_PORT            PORTD
 #define TWI_DDR             DDRD
+#define TWI_PIN             PIND
 #define TWI_SCL_PULL_UP     0
 #define TWI_SDA_PULL_UP     1
 
@@ -44,7 +102,13 @@ typedef struct __twiContext_t
 #endif
 
 
-#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega2560__)
+// Disable interrupts (SREG is saved and restored around it)
+#ifndef TWI_CLI
+#define TWI_CLI()           asm volatile("cli" ::)
+#endif
+
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega2560__) || \
+    defined(TWI_HOST)
 
 //
 // NOTE
@@ -61,20 +125,20 @@ typedef struct __twiContext_t
 #define TWCR_ADDR           0xbc    // TWI Control Register
 #define TWAMR_ADDR          0xbd    // TWI (Slave) Address Mask Register
 
-// Memory mapped IO addresses for TWI (I2C)
-extern volatile uint8_t * const pui8Twbr; // Register TWBR
-extern volatile uint8_t * const pui8Twsr; // Register TWSR
-extern volatile uint8_t * const pui8Twar; // Register TWAR
-extern volatile uint8_t * const pui8Twdr; // Register TWDR
-extern volatile uint8_t * const pui8Twcr; // Register TWCR
-extern volatile uint8_t * const pui8Twamr;// Register TWAMR
-
-#define TWBR                (*pui8Twbr)
-#define TWSR                (*pui8Twsr)
-#define TWAR                (*pui8Twar)
-#define TWDR                (*pui8Twdr)
-#define TWCR                (*pui8Twcr)
-#define TWAMR               (*pui8Twamr)
+// Registers are accessed at their address (no pointer to load 
+// first), so the ISR gets a single lds/sts per access.
+// Host builds (TWI_HOST) define TWI_REG in twihost.h, so each access
+// goes to the bus model instead, the driver only ever touches TWI
+// through these.
+#ifndef TWI_REG
+#define TWI_REG(addr)       (*(volatile uint8_t *)(addr))
+#endif
+#define TWBR                TWI_REG(TWBR_ADDR)
+#define TWSR                TWI_REG(TWSR_ADDR)
+#define TWAR                TWI_REG(TWAR_ADDR)
+#define TWDR                TWI_REG(TWDR_ADDR)
+#define TWCR                TWI_REG(TWCR_ADDR)
+#define TWAMR               TWI_REG(TWAMR_ADDR)
 
 // TWI Control register bit definitions
 #define TWCR_BIT_TWINT      7       // TWI Interrupt Flag
@@ -88,6 +152,30 @@ extern volatile uint8_t * const pui8Twamr;// Register TWAMR
 #define TWCR_MASK_READY     (b2m(TWCR_BIT_TWEN) | b2m(TWCR_BIT_TWIE) | \
                              b2m(TWCR_BIT_TWEA))
 
+// Same as ready but NOT acknowledging the next byte (TWEA cleared),
+// used when receiving/sending the last byte
+#define TWCR_MASK_READY_NACK (b2m(TWCR_BIT_TWEN) | b2m(TWCR_BIT_TWIE))
+
+// Actions, value written to TWCR to move on from a state
+#define TWCR_ACT_ACK        (TWCR_MASK_READY | b2m(TWCR_BIT_TWINT))
+#define TWCR_ACT_NACK       (TWCR_MASK_READY_NACK | b2m(TWCR_BIT_TWINT))
+#define TWCR_ACT_START      (TWCR_ACT_ACK | b2m(TWCR_BIT_TWSTA))
+#define TWCR_ACT_STOP       (TWCR_ACT_ACK | b2m(TWCR_BIT_TWSTO))
+
+// Polled mode (see twiPollTransfer()), same actions but with the
+// interrupt disabled, TWINT is polled instead. START and SLA+R/W
+// are sent with TWEA set, so our own address is still recognized
+// if another master addresses us before we get the bus, or wins
+// arbitration over us with it (0x68/0x78/0xb0)
+#define TWCR_POLL_NACK      (b2m(TWCR_BIT_TWEN) | b2m(TWCR_BIT_TWINT))
+#define TWCR_POLL_ACK       (TWCR_POLL_NACK | b2m(TWCR_BIT_TWEA))
+#define TWCR_POLL_START     (TWCR_POLL_ACK | b2m(TWCR_BIT_TWSTA))
+#define TWCR_POLL_STOP      (TWCR_POLL_NACK | b2m(TWCR_BIT_TWSTO))
+
+// TWI state for a status code (TWSR with pre-scaler bits masked),
+// states go from 0 to 31 so a switch on them is a dense jump table
+#define TWI_ST(status)      ((status) >> 3)
+
 // TWI (Slave) Address Register bit definitions
 // Bits 7:6 define the slave address
 #define TWAR_BIT_TWGCE      0       // TWI General Call Recognition Enable Bit
@@ -95,33 +183,6 @@ extern volatile uint8_t * const pui8Twamr;// Register TWAMR
 // SLA+R/W (TWDR) definitions (1:Rd, 0:Wr)
 #define SLA_RW_BIT_RD       0
 
-// Set the value of TPWS1:0 and TWBR register for the given SCL freq.
-inline void twiSetBitRateDivisionFactor(
-        const unsigned long SCLFreqKHz,     // Target SCL frequency
-        const unsigned char twps            // TWPS
-)
-{
-    // This is the devisor as defined in data sheet
-    // "Bit Rate Generator Unit"
-    //
-    // SCL frequency = CPU clock frequency / { 16 + [ 2 * TWBR * 4^TWPS ] }
-    // or
-    // TWBR = { [ CPU clock frequency / SCL frequency] - 16 } / { 2 * 4^TPWS }
-    // simplified to (using SCL frequency in KHz):
-    // TWBR = { [ ( CPU clock frequency / 2000 ) / SCL frequency KHz ] - 8 } / { 4 ^ TPWS }
-    //
-    // 4 ^ TWPS implemented with left shift operations to obtain
-    // a pre-scaler of 1, 4, 16 or 64 for TWPS 0, 1, 2, 3 respectively.
-    //
-    // These are ranges for all TWPS values:
-    // TWPS = 0: SCL freqs. [31, 888] KHz, Returned values [250, 1]
-    // TWPS = 1: SCL freqs. [ 8, 666] KHz, Returned values [248, 1]
-    // TWPS = 2: SCL freqs. [ 2, 333] KHz, Returned values [250, 1]
-    // TWPS = 3: SCL freqs. [ .5,111] KHz, Returned values [250, 1]
-    TWSR = twps & 0x3;
-    TWBR = (((F_CPU / 2000) / SCLFreqKHz) - 8) / (1 << ((twps & 0x3) << 1));
-}
-
 #else
 #error Unsupported
 #endif
@@ -81,6 +81,10 @@
 #undef TCCR1B
 #endif
 
+#ifdef TCNT1 // Register
+#undef TCNT1
+#endif
+
 #ifdef OCR1A // Register
 #undef OCR1A
 #endif
@@ -0,0 +1,1050 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <dbg.h>
+#include <twipriv.h>
+#include <twiapi.h>
+#include <twibus.h>
+
+// One copy of the driver per node
+#define TWI_BUS_NODE twiNode0
+#include "twinode.h"
+#define TWI_BUS_NODE twiNode1
+#include "twinode.h"
+#define TWI_BUS_NODE twiNode2
+#include "twinode.h"
+#define TWI_BUS_NODE twiNode3
+#include "twinode.h"
+#define TWI_BUS_NODE twiNode4
+#include "twinode.h"
+#define TWI_BUS_NODE twiNode5
+#include "twinode.h"
+#define TWI_BUS_NODE twiNode6
+#include "twinode.h"
+#define TWI_BUS_NODE twiNode7
+#include "twinode.h"
+
+static const twiBusApi_t * const g_twiBusApis[TWI_BUS_MAX_NODES] =
+{
+    &twiNode0::g_twiBusApi, &twiNode1::g_twiBusApi,
+    &twiNode2::g_twiBusApi, &twiNode3::g_twiBusApi,
+    &twiNode4::g_twiBusApi, &twiNode5::g_twiBusApi,
+    &twiNode6::g_twiBusApi, &twiNode7::g_twiBusApi,
+};
+
+// CPU cycles per ms
+#define TWI_BUS_MS          (F_CPU / 1000UL)
+
+// Polled transfers (TWIE cleared), CPU cycles per spin on TWCR
+// (as twiPollWait() assumes, see TWI_POLL_SPINS_MS), and from
+// TWINT seen set to TWINT cleared (read TWSR/TWDR, write TWDR/TWCR)
+#define TWI_BUS_SPIN_CYCLES 10
+#define TWI_BUS_POLL_CYCLES 20
+
+// Node's TWI mode, as far as the bus is concerned
+#define NODE_NA             0   // Not addressed (idle, or waiting to START)
+#define NODE_MASTER         1   // Master (Transmitter or Receiver)
+#define NODE_SRX            2   // Slave Receiver
+#define NODE_STX            3   // Slave Transmitter
+
+// Bus phases, timed ones last until g_bus.until
+#define BUS_FREE            0
+#define BUS_START           1   // START (or repeated START), timed
+#define BUS_WAIT            2   // Waiting for the nodes involved (TWINT set)
+#define BUS_BYTE            3   // Byte and its ACK, timed
+#define BUS_STOP            4   // STOP, timed
+
+// Next byte on the bus
+#define XFER_SLA            0   // SLA+R/W, after a START
+#define XFER_WRITE          1   // Data, master to slaves
+#define XFER_READ           2   // Data, slave to masters
+
+struct __twiBusNode_t
+{
+    const twiBusApi_t *api;
+
+    // Registers, TWCR without TWINT (see twint) and TWSR split
+    // into the status and the pre-scaler
+    uint8_t twbr;
+    uint8_t twps;
+    uint8_t twar;
+    uint8_t twdr;
+    uint8_t twcr;
+    uint8_t twamr;
+    uint8_t port;
+    uint8_t ddr;
+    uint8_t sreg;
+
+    // TWINT, and the status shown with it
+    bool twint;
+    uint8_t status;
+
+    // TWINT was set with TWIE cleared, ISR_Twi is called once set
+    bool isrPending;
+
+    uint8_t mode;
+
+    // TWI was disabled (TWEN cleared), it let go of the bus
+    bool reset;
+
+    // Lost arbitration in SLA+R/W, if addressed it is told so
+    // (0x68/0x78/0xb0)
+    bool lost;
+
+    // Lost arbitration in a data byte, let go of the bus and is
+    // told so (0x38) at this time (0 if not)
+    uint64_t lostAt;
+
+    // When TWINT was last cleared (plus isrCycles)
+    uint64_t readyAt;
+    // ISR_Twi latency and run time (CPU cycles)
+    uint32_t isrCycles;
+
+    uint64_t nextTick;
+
+    // SCL level last read from TWI_PIN, while someone else
+    // clocks the bus
+    bool sclLow;
+
+    uint8_t trace[TWI_BUS_TRACE_LEN];
+    uint64_t traceAt[TWI_BUS_TRACE_LEN];
+    uint16_t traceLen;
+};
+
+typedef struct __twiBus_t
+{
+    uint64_t now;
+    uint8_t count;
+    twiBusTick_t tick;
+
+    uint8_t phase;
+    uint64_t begin;
+    uint64_t until;
+    uint64_t freeAt;
+    uint64_t busySince;
+
+    // Nodes (bit masks) being master, and addressed as slaves
+    uint8_t masters;
+    uint8_t slaves;
+
+    uint8_t xfer;
+    bool repeated;
+    bool gc;
+
+    // SCL period (CPU cycles) set by the master that got the bus
+    uint32_t period;
+
+    // SDA held low by a stuck slave, until it gets this many SCL 
+    // pulses (see twiBusStickSda())
+    uint8_t stuckSda;
+
+    twiBusStats_t stats;
+} twiBus_t;
+
+static twiBus_t g_bus;
+static twiBusNode_t g_twiBusNodes[TWI_BUS_MAX_NODES];
+
+#define NODE_BIT(n)         b2m((n) - g_twiBusNodes)
+
+static void twiBusRunUntil(uint64_t end);
+
+uint8_t twiBusRead(twiBusNode_t *node, uint8_t addr)
+{
+    uint8_t value = 0;
+
+    switch (addr)
+    {
+        case TWBR_ADDR:
+            value = node->twbr;
+            break;
+        case TWSR_ADDR:
+            value = node->status | node->twps;
+            break;
+        case TWAR_ADDR:
+            value = node->twar;
+            break;
+        case TWDR_ADDR:
+            value = node->twdr;
+            break;
+        case TWCR_ADDR:
+            if ((node->twcr & b2m(TWCR_BIT_TWEN)) && 
+                !(node->twcr & b2m(TWCR_BIT_TWIE)) && !node->twint)
+            {
+                // Spinning on TWINT, the bus moves on meanwhile
+                twiBusRunUntil(g_bus.now + TWI_BUS_SPIN_CYCLES);
+            }
+            value = node->twcr | (node->twint ? b2m(TWCR_BIT_TWINT) : 0);
+            break;
+        case TWAMR_ADDR:
+            value = node->twamr;
+            break;
+        case TWI_HOST_PORT_ADDR:
+            value = node->port;
+            break;
+        case TWI_HOST_DDR_ADDR:
+            value = node->ddr;
+            break;
+        case TWI_HOST_PIN_ADDR:
+            // Lines are pulled up, unless driven low by us or by
+            // someone else clocking the bus
+            value = b2m(TWI_SCL_PULL_UP) | b2m(TWI_SDA_PULL_UP);
+            if (g_bus.stuckSda)
+            {
+                // Nobody clocks a stuck bus
+                value &= ~b2m(TWI_SDA_PULL_UP);
+            }
+            else if (g_bus.phase != BUS_FREE && !(g_bus.masters & NODE_BIT(node)))
+            {
+                node->sclLow = !node->sclLow;
+                if (node->sclLow)
+                {
+                    value &= ~b2m(TWI_SCL_PULL_UP);
+                }
+            }
+            value &= ~node->ddr;
+            break;
+        case TWI_HOST_SREG_ADDR:
+            value = node->sreg;
+            break;
+        default:
+            g_bus.stats.errors++;
+    }
+
+    return value;
+}
+
+void twiBusWrite(twiBusNode_t *node, uint8_t addr, uint8_t value)
+{
+    switch (addr)
+    {
+        case TWBR_ADDR:
+            node->twbr = value;
+            break;
+        case TWSR_ADDR:
+            // Only the pre-scaler bits are writable
+            node->twps = value & 0x3;
+            break;
+        case TWAR_ADDR:
+            node->twar = value;
+            break;
+        case TWDR_ADDR:
+            node->twdr = value;
+            break;
+        case TWCR_ADDR:
+            if (!(value & b2m(TWCR_BIT_TWEN)))
+            {
+                // Acted upon once the node's code returns
+                node->reset = true;
+                node->twint = false;
+            }
+            node->twcr = value & ~b2m(TWCR_BIT_TWINT);
+            if (value & b2m(TWCR_BIT_TWINT))
+            {
+                node->twint = false;
+                node->isrPending = false;
+                node->readyAt = g_bus.now + ((value & b2m(TWCR_BIT_TWIE)) ? 
+                                             node->isrCycles : TWI_BUS_POLL_CYCLES);
+            }
+            break;
+        case TWAMR_ADDR:
+            node->twamr = value;
+            break;
+        case TWI_HOST_PORT_ADDR:
+            node->port = value;
+            break;
+        case TWI_HOST_DDR_ADDR:
+            if (g_bus.stuckSda && (node->ddr & ~value & b2m(TWI_SCL_PULL_UP)))
+            {
+                // SCL pulse (released after being driven low)
+                g_bus.stuckSda--;
+            }
+            node->ddr = value;
+            break;
+        case TWI_HOST_SREG_ADDR:
+            node->sreg = value;
+            break;
+        default:
+            g_bus.stats.errors++;
+    }
+}
+
+// Set TWINT of a node with status, ISR_Twi is called if enabled
+static void twiBusRaise(twiBusNode_t *node, uint8_t status)
+{
+    node->status = status;
+    node->twint = true;
+    if (node->traceLen < TWI_BUS_TRACE_LEN)
+    {
+        node->trace[node->traceLen] = status;
+        node->traceAt[node->traceLen] = g_bus.now;
+        node->traceLen++;
+    }
+
+    if ((node->twcr & b2m(TWCR_BIT_TWEN)) && (node->twcr & b2m(TWCR_BIT_TWIE)))
+    {
+        node->api->isr();
+    }
+    else
+    {
+        node->isrPending = true;
+    }
+}
+
+// Bus is released (STOP, or the last master let go of it):
+// slave receivers see STOP, slave transmitters are done
+static void twiBusRelease(void)
+{
+    uint8_t slaves = g_bus.slaves;
+    twiBusNode_t *node;
+    uint8_t i;
+
+    g_bus.phase = BUS_FREE;
+    g_bus.freeAt = g_bus.now + g_bus.period / 2;
+    g_bus.stats.busyCycles += g_bus.now - g_bus.busySince;
+    g_bus.stats.transactions++;
+    g_bus.masters = 0;
+    g_bus.slaves = 0;
+
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (node->mode == NODE_MASTER)
+        {
+            node->mode = NODE_NA;
+            node->twcr &= ~b2m(TWCR_BIT_TWSTO);
+        }
+        else if (slaves & b2m(i))
+        {
+            // Only a Slave Receiver is told (0xa0)
+            if (node->mode == NODE_SRX)
+            {
+                node->mode = NODE_NA;
+                twiBusRaise(node, 0xa0);
+            }
+            node->mode = NODE_NA;
+        }
+    }
+}
+
+// Repeated START: slaves see it as STOP (0xa0), and are
+// addressed again (or not) by the SLA+R/W that follows
+static void twiBusRepeatedStart(void)
+{
+    uint8_t slaves = g_bus.slaves;
+    twiBusNode_t *node;
+    uint8_t i;
+
+    g_bus.slaves = 0;
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (slaves & b2m(i))
+        {
+            if (node->mode == NODE_SRX)
+            {
+                node->mode = NODE_NA;
+                twiBusRaise(node, 0xa0);
+            }
+            node->mode = NODE_NA;
+        }
+    }
+}
+
+// TWI of a node was disabled, it lets go of the bus
+static void twiBusDrop(twiBusNode_t *node)
+{
+    uint8_t bit = NODE_BIT(node);
+
+    node->mode = NODE_NA;
+    node->twint = false;
+    g_bus.slaves &= ~bit;
+    if (g_bus.masters & bit)
+    {
+        g_bus.masters &= ~bit;
+        if (g_bus.masters == 0 && g_bus.phase != BUS_FREE)
+        {
+            // twiBusClear() sends STOP
+            twiBusRelease();
+        }
+    }
+}
+
+// Nodes waiting to send START: not addressed, TWSTA set and TWINT
+// cleared
+static uint8_t twiBusStarting(void)
+{
+    twiBusNode_t *node;
+    uint8_t starting = 0;
+    uint8_t i;
+
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (node->mode == NODE_NA && !node->twint &&
+            (node->twcr & b2m(TWCR_BIT_TWEN)) &&
+            (node->twcr & b2m(TWCR_BIT_TWSTA)))
+        {
+            starting |= b2m(i);
+        }
+    }
+
+    return starting;
+}
+
+// Lowest numbered node in a (non empty) mask
+static twiBusNode_t *twiBusFirst(uint8_t mask)
+{
+    uint8_t i = 0;
+
+    while (!(mask & b2m(i)))
+    {
+        i++;
+    }
+
+    return &g_twiBusNodes[i];
+}
+
+// SLA+R/W sent, settle arbitration and address slaves
+static void twiBusSla(void)
+{
+    twiBusNode_t *node;
+    uint8_t sla = 0xff;
+    uint8_t lost = 0;
+    uint8_t addr;
+    bool rd;
+    bool match;
+    uint8_t i;
+
+    // Lowest value wins: SDA is wired-AND, first 0 sent where
+    // others sent 1 wins
+    for (i = 0; i < g_bus.count; i++)
+    {
+        if ((g_bus.masters & b2m(i)) && g_twiBusNodes[i].twdr < sla)
+        {
+            sla = g_twiBusNodes[i].twdr;
+        }
+    }
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if ((g_bus.masters & b2m(i)) && node->twdr != sla)
+        {
+            node->mode = NODE_NA;
+            node->lost = true;
+            lost |= b2m(i);
+        }
+    }
+    g_bus.masters &= ~lost;
+
+    addr = sla >> 1;
+    rd = (sla & b2m(SLA_RW_BIT_RD)) != 0;
+    g_bus.gc = (addr == TWI_GC_ADDRESS);
+    g_bus.xfer = rd ? XFER_READ : XFER_WRITE;
+    g_bus.slaves = 0;
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (node->mode != NODE_NA || !(node->twcr & b2m(TWCR_BIT_TWEN)) ||
+            !(node->twcr & b2m(TWCR_BIT_TWEA)))
+        {
+            continue;
+        }
+        if (g_bus.gc)
+        {
+            match = !rd && (node->twar & b2m(TWAR_BIT_TWGCE));
+        }
+        else
+        {
+            match = ((addr ^ (node->twar >> 1)) & ~(node->twamr >> 1) & 0x7f) == 0;
+        }
+        if (match)
+        {
+            node->mode = rd ? NODE_STX : NODE_SRX;
+            node->twdr = sla;
+            g_bus.slaves |= b2m(i);
+        }
+    }
+
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (g_bus.masters & b2m(i))
+        {
+            if (rd)
+            {
+                twiBusRaise(node, g_bus.slaves ? 0x40 : 0x48);
+            }
+            else
+            {
+                twiBusRaise(node, g_bus.slaves ? 0x18 : 0x20);
+            }
+        }
+        else if (g_bus.slaves & b2m(i))
+        {
+            if (rd)
+            {
+                twiBusRaise(node, node->lost ? 0xb0 : 0xa8);
+            }
+            else if (g_bus.gc)
+            {
+                twiBusRaise(node, node->lost ? 0x78 : 0x70);
+            }
+            else
+            {
+                twiBusRaise(node, node->lost ? 0x68 : 0x60);
+            }
+        }
+        else if (lost & b2m(i))
+        {
+            twiBusRaise(node, 0x38);
+        }
+        node->lost = false;
+    }
+}
+
+// Data byte about to be written by more than one master, settle
+// arbitration bit by bit (MSB first): SDA is wired-AND, a master
+// sending 1 where another one sends 0 loses, it lets go of the bus
+// at the end of that bit. Unlike SLA+R/W (see twiBusSla()), nobody
+// can be addressed, so it is told right away (0x38)
+static void twiBusArbitrate(uint64_t begin)
+{
+    twiBusNode_t *node;
+    uint8_t bit;
+    uint8_t sda;
+    uint8_t i;
+
+    for (bit = 0; bit < 8 && (g_bus.masters & (g_bus.masters - 1)); bit++)
+    {
+        sda = 0x80 >> bit;
+        for (i = 0; i < g_bus.count; i++)
+        {
+            if (g_bus.masters & b2m(i))
+            {
+                sda &= g_twiBusNodes[i].twdr;
+            }
+        }
+        for (i = 0; i < g_bus.count; i++)
+        {
+            node = &g_twiBusNodes[i];
+            if ((g_bus.masters & b2m(i)) && ((node->twdr ^ sda) & (0x80 >> bit)))
+            {
+                node->mode = NODE_NA;
+                node->lostAt = begin + (bit + 1) * g_bus.period;
+                g_bus.masters &= ~b2m(i);
+            }
+        }
+    }
+}
+
+// Data byte written by the master(s)
+static void twiBusWriteByte(void)
+{
+    twiBusNode_t *node;
+    uint8_t data = 0xff;
+    uint8_t lost = 0;
+    uint8_t nacked = 0;
+    bool ack = false;
+    uint8_t i;
+
+    for (i = 0; i < g_bus.count; i++)
+    {
+        if ((g_bus.masters & b2m(i)) && g_twiBusNodes[i].twdr < data)
+        {
+            data = g_twiBusNodes[i].twdr;
+        }
+    }
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if ((g_bus.masters & b2m(i)) && node->twdr != data)
+        {
+            node->mode = NODE_NA;
+            lost |= b2m(i);
+        }
+        else if (g_bus.slaves & b2m(i))
+        {
+            node->twdr = data;
+            if (node->twcr & b2m(TWCR_BIT_TWEA))
+            {
+                ack = true;
+            }
+            else
+            {
+                // NACK returned, no longer addressed
+                node->mode = NODE_NA;
+                nacked |= b2m(i);
+            }
+        }
+    }
+    g_bus.masters &= ~lost;
+    g_bus.slaves &= ~nacked;
+
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (g_bus.masters & b2m(i))
+        {
+            twiBusRaise(node, ack ? 0x28 : 0x30);
+        }
+        else if (g_bus.slaves & b2m(i))
+        {
+            twiBusRaise(node, g_bus.gc ? 0x90 : 0x80);
+        }
+        else if (nacked & b2m(i))
+        {
+            twiBusRaise(node, g_bus.gc ? 0x98 : 0x88);
+        }
+        else if (lost & b2m(i))
+        {
+            twiBusRaise(node, 0x38);
+        }
+    }
+}
+
+// Data byte read by the master(s)
+static void twiBusReadByte(void)
+{
+    twiBusNode_t *node;
+    uint8_t data = 0xff;
+    uint8_t lost = 0;
+    uint8_t done = 0;
+    bool ack = false;
+    uint8_t i;
+
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (g_bus.slaves & b2m(i))
+        {
+            data &= node->twdr;
+        }
+        else if ((g_bus.masters & b2m(i)) && (node->twcr & b2m(TWCR_BIT_TWEA)))
+        {
+            ack = true;
+        }
+    }
+
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (g_bus.masters & b2m(i))
+        {
+            if (ack && !(node->twcr & b2m(TWCR_BIT_TWEA)))
+            {
+                // Sent NACK where another master sent ACK
+                node->mode = NODE_NA;
+                lost |= b2m(i);
+            }
+            else
+            {
+                node->twdr = data;
+            }
+        }
+        else if ((g_bus.slaves & b2m(i)) &&
+                 (!ack || !(node->twcr & b2m(TWCR_BIT_TWEA))))
+        {
+            // NACKed (0xc0), or ACKed after the last byte (0xc8),
+            // no longer addressed
+            node->mode = NODE_NA;
+            done |= b2m(i);
+        }
+    }
+    g_bus.masters &= ~lost;
+
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (g_bus.masters & b2m(i))
+        {
+            twiBusRaise(node, ack ? 0x50 : 0x58);
+        }
+        else if (done & b2m(i))
+        {
+            g_bus.slaves &= ~b2m(i);
+            twiBusRaise(node, ack ? 0xc8 : 0xc0);
+        }
+        else if (g_bus.slaves & b2m(i))
+        {
+            twiBusRaise(node, 0xb8);
+        }
+        else if (lost & b2m(i))
+        {
+            twiBusRaise(node, 0x38);
+        }
+    }
+}
+
+// Timed phase is over
+static void twiBusPhaseEnd(void)
+{
+    twiBusNode_t *node;
+    uint8_t i;
+
+    switch (g_bus.phase)
+    {
+        case BUS_START:
+            if (g_bus.repeated)
+            {
+                twiBusRepeatedStart();
+            }
+            else if (g_bus.masters & (g_bus.masters - 1))
+            {
+                g_bus.stats.collisions++;
+            }
+            g_bus.phase = BUS_WAIT;
+            g_bus.xfer = XFER_SLA;
+            for (i = 0; i < g_bus.count; i++)
+            {
+                node = &g_twiBusNodes[i];
+                if (g_bus.masters & b2m(i))
+                {
+                    node->mode = NODE_MASTER;
+                    twiBusRaise(node, g_bus.repeated ? 0x10 : 0x08);
+                }
+            }
+            break;
+        case BUS_BYTE:
+            g_bus.phase = BUS_WAIT;
+            if (g_bus.xfer == XFER_SLA)
+            {
+                twiBusSla();
+            }
+            else if (g_bus.xfer == XFER_WRITE)
+            {
+                twiBusWriteByte();
+            }
+            else
+            {
+                twiBusReadByte();
+            }
+            break;
+        case BUS_STOP:
+            twiBusRelease();
+            break;
+    }
+}
+
+// What the master(s) do next, once every node involved cleared TWINT
+static void twiBusNext(void)
+{
+    uint8_t involved = g_bus.masters | g_bus.slaves;
+    twiBusNode_t *master;
+    twiBusNode_t *node;
+    uint64_t t = g_bus.now;
+    uint8_t i;
+
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (involved & b2m(i))
+        {
+            if (node->twint)
+            {
+                return;
+            }
+            if (node->readyAt > t)
+            {
+                t = node->readyAt;
+            }
+        }
+    }
+
+    // Masters still in arbitration have sent the same so far,
+    // they are expected to carry on the same way
+    master = twiBusFirst(g_bus.masters);
+    g_bus.begin = t;
+    if (master->twcr & b2m(TWCR_BIT_TWSTO))
+    {
+        g_bus.phase = BUS_STOP;
+        g_bus.until = t + g_bus.period;
+    }
+    else if (master->twcr & b2m(TWCR_BIT_TWSTA))
+    {
+        g_bus.phase = BUS_START;
+        g_bus.repeated = true;
+        g_bus.until = t + g_bus.period;
+    }
+    else
+    {
+        if (master->status == 0x48)
+        {
+            // SLA+R NACKed, only STOP or repeated START are allowed
+            g_bus.stats.errors++;
+        }
+        g_bus.phase = BUS_BYTE;
+        g_bus.until = t + 9 * g_bus.period;
+        if (g_bus.xfer == XFER_WRITE)
+        {
+            twiBusArbitrate(t);
+        }
+    }
+}
+
+// Move the bus on as far as it goes without time passing
+static void twiBusStep(void)
+{
+    twiBusNode_t *node;
+    uint8_t starting;
+    uint8_t i;
+
+    for (i = 0; i < g_bus.count; i++)
+    {
+        node = &g_twiBusNodes[i];
+        if (node->reset)
+        {
+            // TWI disabled
+            node->reset = false;
+            node->isrPending = false;
+            twiBusDrop(node);
+        }
+        else if (node->isrPending && node->twint &&
+                 (node->twcr & b2m(TWCR_BIT_TWEN)) && 
+                 (node->twcr & b2m(TWCR_BIT_TWIE)))
+        {
+            // TWIE set back with TWINT left set (e.g. after a polled
+            // transfer)
+            node->isrPending = false;
+            node->api->isr();
+        }
+    }
+
+    if (g_bus.phase == BUS_WAIT)
+    {
+        if (g_bus.masters == 0)
+        {
+            // Nobody left to drive the bus (should not happen)
+            g_bus.stats.errors++;
+            twiBusRelease();
+        }
+        else
+        {
+            twiBusNext();
+        }
+    }
+
+    starting = twiBusStarting();
+    if (g_bus.phase == BUS_FREE && starting && g_bus.now >= g_bus.freeAt &&
+        !g_bus.stuckSda)
+    {
+        // Every node waiting for the bus sends START at once
+        node = twiBusFirst(starting);
+        g_bus.phase = BUS_START;
+        g_bus.repeated = false;
+        g_bus.masters = starting;
+        g_bus.slaves = 0;
+        g_bus.period = 16 + ((uint32_t)node->twbr << (1 + 2 * node->twps));
+        g_bus.begin = g_bus.now;
+        g_bus.busySince = g_bus.now;
+        g_bus.until = g_bus.now + g_bus.period;
+    }
+    else if (g_bus.phase == BUS_START && !g_bus.repeated &&
+             g_bus.now < g_bus.begin + g_bus.period / 2)
+    {
+        // START sent before seeing the other one, it collides
+        g_bus.masters |= starting;
+    }
+}
+
+void twiBusInit(uint8_t nodes, uint32_t isrCycles, twiBusTick_t tick)
+{
+    twiBusInitApis(nodes, isrCycles, tick, g_twiBusApis);
+}
+
+void twiBusInitApis(uint8_t nodes, uint32_t isrCycles, twiBusTick_t tick,
+                    const twiBusApi_t * const *apis)
+{
+    twiBusNode_t *node;
+    uint8_t i;
+
+    memset(&g_bus, 0, sizeof(g_bus));
+    memset(g_twiBusNodes, 0, sizeof(g_twiBusNodes));
+    g_bus.count = (nodes <= TWI_BUS_MAX_NODES) ? nodes : TWI_BUS_MAX_NODES;
+    g_bus.tick = tick;
+    g_bus.phase = BUS_FREE;
+    // Until someone gets the bus, 100KHz at 16MHz
+    g_bus.period = 160;
+
+    for (i = 0; i < TWI_BUS_MAX_NODES; i++)
+    {
+        node = &g_twiBusNodes[i];
+        node->api = apis[i];
+        *node->api->host = node;
+        node->sreg = 0x80;
+        node->status = 0xf8;
+        node->isrCycles = isrCycles;
+        // Spread ticks over the ms, nodes have their own clocks
+        node->nextTick = TWI_BUS_MS / 2 + i * TWI_BUS_MS / TWI_BUS_MAX_NODES;
+    }
+}
+
+const twiBusApi_t *twiBusNode(uint8_t node)
+{
+    return g_twiBusNodes[node].api;
+}
+
+// Run the bus until end (CPU cycles). Also called from node code,
+// while it spins on TWINT, ticks (as timer interrupts) and other 
+// nodes go on meanwhile
+static void twiBusRunUntil(uint64_t end)
+{
+    twiBusNode_t *node;
+    uint64_t tBus;
+    uint64_t t;
+    uint8_t i;
+
+    // Whatever the nodes were told to do between runs
+    twiBusStep();
+
+    for (;;)
+    {
+        // Next bus event, if any
+        tBus = end + 1;
+        if (g_bus.phase == BUS_START || g_bus.phase == BUS_BYTE ||
+            g_bus.phase == BUS_STOP)
+        {
+            tBus = g_bus.until;
+        }
+        else if (g_bus.phase == BUS_FREE && !g_bus.stuckSda && twiBusStarting())
+        {
+            tBus = (g_bus.freeAt > g_bus.now) ? g_bus.freeAt : g_bus.now;
+        }
+
+        t = tBus;
+        for (i = 0; i < g_bus.count; i++)
+        {
+            node = &g_twiBusNodes[i];
+            if (node->nextTick < t)
+            {
+                t = node->nextTick;
+            }
+            if (node->lostAt && node->lostAt < t)
+            {
+                t = node->lostAt;
+            }
+        }
+        if (t > end)
+        {
+            break;
+        }
+        g_bus.now = t;
+
+        for (i = 0; i < g_bus.count; i++)
+        {
+            node = &g_twiBusNodes[i];
+            if (node->lostAt == t)
+            {
+                node->lostAt = 0;
+                twiBusRaise(node, 0x38);
+            }
+        }
+
+        if (t == tBus)
+        {
+            // START from a free bus is sent by twiBusStep()
+            if (g_bus.phase != BUS_FREE)
+            {
+                twiBusPhaseEnd();
+            }
+        }
+        else
+        {
+            for (i = 0; i < g_bus.count; i++)
+            {
+                node = &g_twiBusNodes[i];
+                if (node->nextTick == t)
+                {
+                    node->nextTick += TWI_BUS_MS;
+                    node->api->tick();
+                    if (g_bus.tick != NULL)
+                    {
+                        g_bus.tick(i);
+                    }
+                }
+            }
+        }
+        twiBusStep();
+    }
+
+    g_bus.now = end;
+    g_bus.stats.cycles = end;
+}
+
+void twiBusRun(uint32_t ms)
+{
+    twiBusRunUntil(g_bus.now + (uint64_t)ms * TWI_BUS_MS);
+}
+
+void twiBusSetIsrCycles(uint8_t node, uint32_t isrCycles)
+{
+    g_twiBusNodes[node].isrCycles = isrCycles;
+}
+
+void twiBusStickSda(uint8_t clocks)
+{
+    g_bus.stuckSda = clocks;
+}
+
+void twiBusGetStats(twiBusStats_t *stats)
+{
+    *stats = g_bus.stats;
+    if (g_bus.phase != BUS_FREE)
+    {
+        // Transaction in progress, so far
+        stats->busyCycles += g_bus.now - g_bus.busySince;
+    }
+}
+
+uint16_t twiBusTrace(uint8_t node, const uint8_t **statuses)
+{
+    *statuses = g_twiBusNodes[node].trace;
+
+    return g_twiBusNodes[node].traceLen;
+}
+
+uint64_t twiBusTraceTime(uint8_t node, uint16_t idx)
+{
+    return g_twiBusNodes[node].traceAt[idx];
+}
+
+void twiBusTraceClear(uint8_t node)
+{
+    g_twiBusNodes[node].traceLen = 0;
+}
+
+void twiBusReport(const char *title)
+{
+    twiBusStats_t bus;
+    twiStats_t stats;
+    uint32_t ms;
+    uint32_t txFrames = 0;
+    uint32_t arbLosses = 0;
+    uint8_t i;
+
+    twiBusGetStats(&bus);
+    ms = (uint32_t)(bus.cycles / TWI_BUS_MS);
+    if (ms == 0)
+    {
+        return;
+    }
+
+    printf("%s: %u nodes, %lu ms\n", title, g_bus.count, (unsigned long)ms);
+    printf("  node  tx/s   rx/s   arbLosses  retries  failures  maxWait(ms)\n");
+    for (i = 0; i < g_bus.count; i++)
+    {
+        g_twiBusNodes[i].api->getStats(&stats);
+        txFrames += stats.txFrames;
+        arbLosses += stats.arbLosses;
+        printf("  %-4u  %-5lu  %-5lu  %-9u  %-7u  %-8u  %u\n", i,
+               (unsigned long)stats.txFrames * 1000 / ms,
+               (unsigned long)stats.rxFrames * 1000 / ms,
+               stats.arbLosses, stats.txRetries, stats.txFailures,
+               stats.txMaxWait);
+    }
+    printf("  bus utilization %lu.%lu%%, %lu frames/s, %lu arbitration losses,"
+           " %lu collisions, %lu errors\n",
+           (unsigned long)(bus.busyCycles * 100 / bus.cycles),
+           (unsigned long)(bus.busyCycles * 1000 / bus.cycles % 10),
+           (unsigned long)txFrames * 1000 / ms, (unsigned long)arbLosses,
+           (unsigned long)bus.collisions, (unsigned long)bus.errors);
+}
\ No newline at end of file
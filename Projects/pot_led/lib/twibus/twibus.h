@@ -0,0 +1,143 @@
+#ifndef __TWIBUS_H__
+#define __TWIBUS_H__
+
+#include <stdint.h>
+
+#include <twihost.h>
+#include <twiapi.h>
+
+//
+// TWI (I2C) bus model, to run several nodes of the TWI driver
+// (twi.cpp, built with TWI_HOST) on the host, e.g. from tests
+//
+// Each node is a copy of the driver with its own state and TWI
+// hardware. The model plays the hardware of every node and the bus
+// between them: START/STOP, SLA+R/W and data bytes with their ACK,
+// bitwise arbitration between masters, address matching (TWAR,
+// TWAMR, General Call), and SCL as seen on TWI_PIN. ISR_Twi of a
+// node is called whenever its TWINT is set, as the AVR would.
+//
+// Time is counted in CPU cycles (F_CPU), bus timing comes from the
+// TWBR/TWPS of the master: a bit is an SCL period of 16 + 2 * TWBR *
+// 4^TWPS cycles, a byte (with its ACK) 9 periods, START/STOP 1 period,
+// and the bus is free half a period after STOP. Arbitration in a data
+// byte is settled bit by bit, the loser gets 0x38 at the end of the
+// bit it lost. In SLA+R/W it is told at the end of the byte, as the
+// AVR does, it may be the one addressed (0x68/0x78/0xb0).
+//
+// Bits are not events of their own, only START, STOP, the end of a
+// byte and arbitration losses are: nodes only see the bus through
+// TWINT, or spinning on TWI_PIN (see twiBusMoving()), where SCL is
+// shown toggling on each read while someone else has the bus. That
+// is enough to tell a moving bus from a stuck one, which is all the
+// driver looks for, without the cost of an event per bit.
+//
+// A stuck bus (SDA held low by a slave that missed clocks) is
+// injected with twiBusStickSda(), to exercise the driver's bus 
+// clear (see twiTick()).
+//
+// Polled transfers (twiPollTransfer()) spin on TWCR with TWIE
+// cleared, each read takes TWI_BUS_SPIN_CYCLES and the bus (and the
+// other nodes, and ticks) move on meanwhile.
+//
+// NOT modeled: SCL stretching by slow nodes (the bus waits for every
+// node involved to clear TWINT, plus isrCycles) and glitches.
+//
+
+// Nodes the bus can have
+#define TWI_BUS_MAX_NODES   8
+
+// Statuses (TWSR) kept per node, see twiBusTrace()
+#define TWI_BUS_TRACE_LEN   256
+
+// Called every 1ms for each node, after its twiTick(), as node code
+// (e.g. to queue packets, as pot_led does from its Timer 1 ISR)
+typedef void (*twiBusTick_t)(uint8_t node);
+
+// Driver of a node, to be called as the node's application would
+typedef struct __twiBusApi_t
+{
+    twiBusNode_t **host;
+    void (*isr)(void);
+    void (*tick)(void);
+    void (*initRate)(uint8_t slaveAddress, uint8_t options, uint8_t addrMask,
+                     twiRxCallback_t rxCallback, uint8_t twbr, uint8_t twps);
+    bool (*send)(twiTxBuf_t *sendBuf);
+    bool (*sendSg)(uint8_t toAddr, const twiSeg_t *segs, uint8_t nsegs);
+    twiTxBuf_t *(*txAcquire)(void);
+    bool (*txCommit)(twiTxBuf_t *sendBuf);
+    uint8_t (*txPending)(void);
+    bool (*recv)(twiRxBuf_t *recvBuf);
+    const twiRxBuf_t *(*rxPeek)(void);
+    void (*rxRelease)(void);
+    bool (*setReply)(const uint8_t *data, uint8_t len);
+    void (*getStats)(twiStats_t *stats);
+    bool (*busy)(void);
+    bool (*pollTransfer)(uint8_t toAddr, const uint8_t *wrData, uint16_t wrLen,
+                         uint8_t *rdData, uint16_t rdLen, uint16_t timeoutMs);
+} twiBusApi_t;
+
+// Bus statistics
+typedef struct __twiBusStats_t
+{
+    // Time simulated, and time the bus was busy (START to STOP),
+    // in CPU cycles
+    uint64_t cycles;
+    uint64_t busyCycles;
+
+    // Transactions (START to STOP), and STARTs sent by more than
+    // one master at once (settled by arbitration)
+    uint32_t transactions;
+    uint32_t collisions;
+
+    // Driver actions the model did not expect (e.g. data sent after
+    // SLA+R was NACKed), the driver must not cause any
+    uint32_t errors;
+} twiBusStats_t;
+
+// Reset the bus, with nodes (up to TWI_BUS_MAX_NODES) idle: TWI
+// disabled, not initialized. isrCycles is how long a node takes
+// to clear TWINT once set (ISR_Twi latency and run time).
+// tick (optional) is called every 1ms for each node
+void twiBusInit(uint8_t nodes, uint32_t isrCycles, twiBusTick_t tick);
+
+// Same, nodes running the drivers in apis (TWI_BUS_MAX_NODES of
+// them) instead of the ones built here, e.g. built by a test with
+// another configuration (see twinode.h)
+void twiBusInitApis(uint8_t nodes, uint32_t isrCycles, twiBusTick_t tick,
+                    const twiBusApi_t * const *apis);
+
+// Driver of a node, its functions may be called between runs
+// (and from tick), they take effect on the next twiBusRun()
+const twiBusApi_t *twiBusNode(uint8_t node);
+
+// Run the bus for ms
+void twiBusRun(uint32_t ms);
+
+// Change isrCycles (see twiBusInit()) for node, e.g. a slave quicker
+// to clear TWINT than an AVR. To be called between runs
+void twiBusSetIsrCycles(uint8_t node, uint32_t isrCycles);
+
+// A slave holds SDA low until it gets clocks SCL pulses (e.g. it was
+// reset mid-byte), nobody can START, SCL does not move. To be called
+// between runs with the bus free
+void twiBusStickSda(uint8_t clocks);
+
+// Get a copy of the bus statistics
+void twiBusGetStats(twiBusStats_t *stats);
+
+// Statuses (TWSR) the node's ISR_Twi was called with since the
+// last twiBusInit() or twiBusTraceClear(), up to TWI_BUS_TRACE_LEN
+// Return how many, statuses points to them
+uint16_t twiBusTrace(uint8_t node, const uint8_t **statuses);
+
+// When (CPU cycles since twiBusInit()) status idx of the trace was set
+uint64_t twiBusTraceTime(uint8_t node, uint16_t idx);
+
+void twiBusTraceClear(uint8_t node);
+
+// Print (stdout) bus utilization, frames per second and arbitration
+// losses, overall and per node
+void twiBusReport(const char *title);
+
+#endif // __TWIBUS_H__
\ No newline at end of file
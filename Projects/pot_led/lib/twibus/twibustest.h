@@ -0,0 +1,50 @@
+#ifndef __TWIBUSTEST_H__
+#define __TWIBUSTEST_H__
+
+#include <twibus.h>
+
+//
+// Fixture shared by the tests running on the bus model (test/test_*),
+// to be included after unity.h
+//
+
+// Nodes are at TEST_ADDR + node
+#define TEST_ADDR           0x10
+
+// ISR_Twi latency and run time (CPU cycles)
+#define TEST_ISR_CYCLES     100
+
+// Reset the bus with nodes at TEST_ADDR + node, running at
+// TWI_SCL_FREQ, tick (may be NULL) called every 1ms for each
+static inline void busInit(uint8_t nodes, twiBusTick_t tick)
+{
+    uint8_t i;
+
+    twiBusInit(nodes, TEST_ISR_CYCLES, tick);
+    for (i = 0; i < nodes; i++)
+    {
+        twiBusNode(i)->initRate(TEST_ADDR + i, 0, 0, NULL,
+                                TwiBitRate<TWI_SCL_FREQ>::twbr,
+                                TwiBitRate<TWI_SCL_FREQ>::twps);
+    }
+}
+
+// Statuses (TWSR) seen by node's ISR_Twi are the len expected ones
+static inline void assertTrace(uint8_t node, const uint8_t *expected, uint16_t len)
+{
+    const uint8_t *statuses;
+
+    TEST_ASSERT_EQUAL(len, twiBusTrace(node, &statuses));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, statuses, len);
+}
+
+// The model saw no driver action it did not expect
+static inline void assertNoErrors(void)
+{
+    twiBusStats_t bus;
+
+    twiBusGetStats(&bus);
+    TEST_ASSERT_EQUAL(0, bus.errors);
+}
+
+#endif // __TWIBUSTEST_H__
\ No newline at end of file
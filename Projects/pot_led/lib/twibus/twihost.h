@@ -0,0 +1,79 @@
+#ifndef __TWIHOST_H__
+#define __TWIHOST_H__
+
+#include <stdint.h>
+
+//
+// Host (TWI_HOST) build of the TWI driver, see twibus.h
+//
+// Each node of the bus model is a copy of twi.cpp compiled in its
+// own namespace, where g_twiHost is the node. Registers the driver
+// touches (TWI, SCL/SDA pins and SREG) are read/written through
+// the bus model, which plays the node's hardware.
+//
+
+typedef struct __twiBusNode_t twiBusNode_t;
+
+// Register access, implemented by the bus model
+uint8_t twiBusRead(twiBusNode_t *node, uint8_t addr);
+void twiBusWrite(twiBusNode_t *node, uint8_t addr, uint8_t value);
+
+// A register of a node, as used by the driver (e.g. TWCR = x,
+// TWI_DDR |= x, data = TWDR)
+class TwiHostReg
+{
+public:
+    TwiHostReg(twiBusNode_t *node, uint8_t addr) : m_node(node), m_addr(addr)
+    {
+    }
+
+    operator uint8_t() const
+    {
+        return twiBusRead(m_node, m_addr);
+    }
+
+    // Values are taken as int, so e.g. &= ~b2m(x) converts silently
+    TwiHostReg &operator=(int value)
+    {
+        twiBusWrite(m_node, m_addr, (uint8_t)value);
+        return *this;
+    }
+
+    TwiHostReg &operator|=(int value)
+    {
+        return *this = twiBusRead(m_node, m_addr) | value;
+    }
+
+    TwiHostReg &operator&=(int value)
+    {
+        return *this = twiBusRead(m_node, m_addr) & value;
+    }
+
+private:
+    twiBusNode_t *m_node;
+    uint8_t m_addr;
+};
+
+#define TWI_REG(addr)       TwiHostReg(g_twiHost, (addr))
+
+// SCL/SDA pins, at the Uno's addresses (Port C)
+#define TWI_HOST_PIN_ADDR   0x26
+#define TWI_HOST_DDR_ADDR   0x27
+#define TWI_HOST_PORT_ADDR  0x28
+#define TWI_HOST_SREG_ADDR  0x5f
+
+#define TWI_PORT            TWI_REG(TWI_HOST_PORT_ADDR)
+#define TWI_DDR             TWI_REG(TWI_HOST_DDR_ADDR)
+#define TWI_PIN             TWI_REG(TWI_HOST_PIN_ADDR)
+#define TWI_SCL_PULL_UP     5
+#define TWI_SDA_PULL_UP     4
+
+// Node code is never interrupted, ISRs are called by the bus model
+// in between
+#define SREG                TWI_REG(TWI_HOST_SREG_ADDR)
+#define TWI_CLI()
+
+// Host has no separate flash address space
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+
+#endif // __TWIHOST_H__
\ No newline at end of file
@@ -0,0 +1,41 @@
+//
+// A node of the bus model: a copy of the TWI driver, in namespace
+// TWI_BUS_NODE, with its own state, its registers being those of
+// g_twiHost (see twihost.h)
+//
+// NOTE Not include guarded, twibus.cpp includes it once per node.
+// Tests may too, to build nodes with another configuration (defined
+// before twiapi.h is first included) in namespaces of their own, see
+// twiBusInitApis()
+//
+
+namespace TWI_BUS_NODE
+{
+
+static twiBusNode_t *g_twiHost;
+
+#include <twi.cpp>
+
+static const twiBusApi_t g_twiBusApi =
+{
+    &g_twiHost,
+    ISR_Twi,
+    twiTick,
+    twiInitRate,
+    twiSend,
+    twiSendSg,
+    twiTxAcquire,
+    twiTxCommit,
+    twiTxPending,
+    twiRecv,
+    twiRxPeek,
+    twiRxRelease,
+    twiSetReply,
+    twiGetStats,
+    twiBusy,
+    twiPollTransfer,
+};
+
+}
+
+#undef TWI_BUS_NODE
\ No newline at end of file
@@ -7,19 +7,23 @@
 //
 // NOTES:
 // In this experiment, I have separated each "peripheral"'s definitions
-// into their own file (e.g. timer.*, adc.*, twi*.*). Only TWI has actual
-// code and an API defined in separate files.
+// into their own file (e.g. timer.*, adc.*, twi*.*). Only TWI and ADC 
+// have actual code and an API defined in separate files.
 //
 // I also have added macros to use the serial debugger with 2 levels
 // of verbosity (see dbg.h)
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 
 #include <dbg.h>
 #include <undef.h>
 #include <gpio.h>
 #include <timer.h>
 #include <adc.h>
+#include <adcapi.h>
 #include <twiapi.h>
+#include <twifrm.h>
 #include <potled.h>
 
 #if __USE_AVR8_STUB__
@@ -45,12 +49,30 @@ extern "C" {
 }
 #endif
 
-// Timer 1 Compare Match B
-void ISR_Timer1_CompB(void)
+static_assert(TWI_FRM_LEN(POTLED_BATCH) <= TWI_MAX_BUF,
+              "POTLED_BATCH too big for TWI_MAX_BUF");
+static_assert(!(POTLED_BROADCAST && POTLED_FETCH_REMOTE),
+              "Can not fetch from the General Call address");
+
+#if POTLED_BROADCAST
+#define POTLED_SEND_ADDRESS TWI_GC_ADDRESS
+#else
+#define POTLED_SEND_ADDRESS TWI_REMOTE_ADDRESS
+#endif
+
+#if ADC_TRIGGER == ADC_TRIG_SLEEP
+// Set every Timer 1 period, loop() then sleeps while the pot 
+// is converted
+static volatile bool g_potledConvert = false;
+#endif
+
+// Frames received (either sent to us or fetched from the other 
+// board), called from ISR_Twi as soon as each one arrives, so the 
+// LED follows the remote pot as fast as the bus allows.
+// Keep it within the twiRxCallback_t budget, TWI_RX_CALLBACK_US
+// (no serial output)
+static void potledRecv(void)
 {
-    uint8_t data;
-    static uint8_t count = 0;
-    static uint8_t old_data = (uint8_t)-1;
     // Values to apply to generate a duty cycle between 0.1 and 20%
     // It follows an exponential (see led-log.xlsx)
     static const uint8_t step[64] = {
@@ -58,61 +80,112 @@ void ISR_Timer1_CompB(void)
         9, 10, 11, 11, 12, 14, 15, 16, 17, 19, 21, 22, 24, 27, 29, 31, 34, 37, 40, 44, 
         48, 52, 57, 62, 67, 73, 79, 86, 94, 102, 111, 121, 131, 143, 155, 169, 184, 200
     };
-    twiRxBuf_t recvBuf;
-    twiTxBuf_t sendBuf;
-    
+    const twiRxBuf_t *recvBuf;
+    const uint8_t *payload;
+    uint8_t header;
+    uint8_t len;
 
-    // First read AD data if available
-    if (ADCSRA & b2m(ADCSRA_BIT_ADIF))
+    while ((recvBuf = twiRxPeek()) != NULL)
     {
-        // We have an AD sample
+        // Invalid frames are just discarded
+        if (twiFrmDecode(recvBuf, &header, &payload, &len) &&
+            (header & TWI_FRM_TYPE_MASK) == TWI_FRM_POT && len > 0)
+        {
+            // Update duty cycle with the latest sample
+            OCR1A = step[payload[len - 1] & 0x3f];
+        }
+        twiRxRelease();
+    }
+}
+
+// Timer 1 Compare Match B
+void ISR_Timer1_CompB(void)
+{
+    uint8_t data;
+    uint16_t sample;
+#if !POTLED_FETCH_REMOTE
+    static uint8_t old_data = (uint8_t)-1;
+    // Samples to send in the next frame
+    static uint8_t batch[POTLED_BATCH];
+#endif
+    // Samples taken since the last frame sent (or fetch)
+    static uint8_t nbatch = 0;
+    // What the other board gets when it reads from us
+    static uint8_t reply[TWI_FRM_LEN(1)];
+    static uint8_t reply_data = (uint8_t)-1;
+#if POTLED_FETCH_REMOTE
+    twiTxBuf_t *sendBuf;
+#else
+    bool changed;
+    uint8_t i;
+#endif
+    
 
+    // First take the pot samples converted since last time
+    while (adcRead(0, &sample, 1) == 1)
+    {
         // We will use 6 MSB, so values go between 0 and 63
-        data = (uint8_t)((ADC >> 4) & 0x3f);
+        data = (uint8_t)((sample >> (ADC_SAMPLE_BITS - 6)) & 0x3f);
+#if !POTLED_FETCH_REMOTE
+        batch[nbatch] = data;
+#endif
+        nbatch++;
+
+        if (data != reply_data)
+        {
+            // Keep it ready for the other board to fetch it
+            twiSetReply(reply, twiFrmBuild(reply, TWI_FRM_POT, &data, 1));
+            reply_data = data;
+        }
 
-        if (data != old_data)
+        if (nbatch >= POTLED_BATCH)
         {
-            sendBuf.toAddr = TWI_REMOTE_ADDRESS;
-            sendBuf.buffer[0] = 'I';
-            sendBuf.buffer[1] = '2';
-            sendBuf.buffer[2] = 'C';
-            sendBuf.buffer[3] = data;
-            sendBuf.len = 4;
-            if (twiSend(&sendBuf))
+#if POTLED_FETCH_REMOTE
+            // Fetch the other board's pot value, nothing to 
+            // write, just read its reply frame
+            sendBuf = twiTxAcquire();
+            if (sendBuf != NULL)
             {
-                // If (starting a) send succeeded, update old_data, 
-                // otherwise don't so we try again on next 
-                // ADC conversion
-                old_data = data;
-                SerialPr(("Starting packet send "));
-                SerialPrLn((data));
+                sendBuf->toAddr = TWI_REMOTE_ADDRESS;
+                sendBuf->len = 0;
+                sendBuf->rdLen = sizeof(reply);
+                twiTxCommit(sendBuf);
             }
-            else
+#else
+            // Only send the batch if the pot moved
+            changed = false;
+            for (i = 0; i < nbatch; i++)
             {
-                SerialPrLn(("Send packet discarded"));
+                changed |= (batch[i] != old_data);
             }
-        }
 
-        // Manually reset interrupt flag as we don't have 
-        // ADC interrupts enabled nor corresponding ISR
-        ADCSRA |= b2m(ADCSRA_BIT_ADIF);
+            if (changed)
+            {
+                if (twiFrmSend(POTLED_SEND_ADDRESS, TWI_FRM_POT, batch, nbatch))
+                {
+                    // If queueing the send succeeded, update old_data, 
+                    // otherwise (send queue full) don't so we try again 
+                    // with the next batch
+                    old_data = batch[nbatch - 1];
+                    SerialPr(("Queued frame send "));
+                    SerialPrLn((old_data));
+                }
+                else
+                {
+                    SerialPrLn(("Send queue full, frame discarded"));
+                }
+            }
+#endif
+            nbatch = 0;
+        }
     }
 
-    // Find out if we have received any data
-    if (twiRecv(&recvBuf) && recvBuf.size == 4)
-    {
-        // ... and we have.
-        // Update duty cycle
-        OCR1A = step[recvBuf.buffer[3] & 0x3f];
-        SerialPrLn(("Received packet"));
-    }
+    // Let TWI keep track of time
+    twiTick();
 
-    count++;
-    if (count >= 100)
-    {
-        count = 0;
-        ADCSRA |= b2m(ADCSRA_BIT_ADSC); // Start a new conversion
-    }
+#if ADC_TRIGGER == ADC_TRIG_SLEEP
+    g_potledConvert = true;
+#endif
 }
 
 void setup(void)
@@ -132,7 +205,9 @@ void setup(void)
     //      Compare Output Mode: COMnB1:0 = 00b
     //          Normal port operation, OCnB disconnected
     //      Match value provided by OCRnA controls duty cycle
-    //      Match value provided by OCRnB determins when to interrupt.
+    //      Match value provided by OCRnB determins when to interrupt,
+    //      and when the ADC converts (ADC_TRIG_T1_COMPB/SLEEP), the
+    //      interrupt clears OCF1B so each match triggers a conversion
     //
     //      Set clock devisor to 8, to feed counter with 2MHz
     //      Duty cycle = (MatchA+1)/(1+TOP) = (OCR1A+1)/(1+ICR1)
@@ -150,37 +225,62 @@ void setup(void)
     // Only bit with external LED is output
     DDRB = b2m(EXT_PIN_OC1A);
 
-    // Configure the ADC as:
-    // 
-    // ADCSRA   ADPS2:0 = 111b Pre-scaler divide by 128 
-    // ADCSRB   ADTS2:0 = 000b Free running mode
-    // ADMUX    REFS1:0 = 01b Internal Vcc reference
-    // ADMUX    ADLAR = 0b Right adjust
-    // ADMUX    MUX4:0 = 00000b Select analog input ADC0
-    //
-    // At maximum resolution, SR=15K samples/sec.
-    // Normally it takes 13 clock cycles for one conversion,
-    // so we need a clock of no more than 195KHz (15K*13).
-    // A clock divisor of 128 will give us 125KHz so we could have 
-    // a maximum SR of 9.6K samples/sec. 
-    // I intend to have 10 conversion/sec, enough to be responsive
-    // while moving the pot
-    ADCSRA = ADCSRA_DIV128;
-    ADCSRB = 0;
-    ADMUX = b2m(ADMUX_BIT_REFS0);
-    DIDR0 = ~b2m(DIDR0_BIT_ADC0D); // 7:1 disabled, 0 enabled
-#if defined(__AVR_ATmega2560__)
-    DIDR2 = 0xff;                  // 15:8 disabled
-#endif
-    ADCSRA |= b2m(ADCSRA_BIT_ADEN) | // Enable AD converter
-              b2m(ADCSRA_BIT_ADSC);  // Start an AD conversion
+    // Pot on analog input ADC0, the ADC converts continuously (about
+    // 9.6K samples/sec), or on each Timer 1 compare B match (1K 
+    // samples/sec, ADC_TRIG_T1_COMPB/SLEEP), and keeps one sample every 
+    // POTLED_SAMPLE_MS, i.e. 40 samples/sec, sent in frames of 
+    // POTLED_BATCH samples, enough to be responsive while moving the pot
+    adcInit(0, POTLED_ADC_DIV);
 
     dbg_breakpoint();
-    twiInit(TWI_LOCAL_ADDRESS);
+    // Also receive pot samples broadcast by any board,
+    // and apply them as soon as they arrive
+    twiInit(TWI_LOCAL_ADDRESS, TWI_INIT_GENERAL_CALL, 0, potledRecv);
 
     asm volatile("sei" ::);
 }
 
 void loop(void)
 {
+#if ADC_TRIGGER == ADC_TRIG_SLEEP
+    // Convert the pot once per Timer 1 period, with the CPU and 
+    // I/O clocks stopped (unless TWI is busy)
+    // NOTE Timer 1 stops too while converting, its period (PWM 
+    // and twiTick()) gets longer by a conversion (about 0.1 ms)
+    if (g_potledConvert)
+    {
+        g_potledConvert = false;
+        adcSleep();
+    }
+#endif
+#if __USE_DEBUG_SPEW__
+    // Report the TWI driver statistics as they change, printing 
+    // from here keeps the serial output out of the ISRs
+    static twiStats_t old_stats;
+    twiStats_t stats;
+
+    twiGetStats(&stats);
+    if (memcmp(&stats, &old_stats, sizeof(stats)) != 0)
+    {
+        SerialPr(("TWI tx:"));
+        SerialPr((stats.txFrames));
+        SerialPr((" rx:"));
+        SerialPr((stats.rxFrames));
+        SerialPr((" addrNack:"));
+        SerialPr((stats.addrNacks));
+        SerialPr((" dataNack:"));
+        SerialPr((stats.dataNacks));
+        SerialPr((" arbLost:"));
+        SerialPr((stats.arbLosses));
+        SerialPr((" ovf:"));
+        SerialPr((stats.rxOverflows));
+        SerialPr((" drop:"));
+        SerialPr((stats.rxDropped));
+        SerialPr((" fail:"));
+        SerialPr((stats.txFailures));
+        SerialPr((" unexp:"));
+        SerialPrLn((stats.unexpected));
+        old_stats = stats;
+    }
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,322 @@
+#include <unity.h>
+
+#include <twibustest.h>
+
+// Ms between frames sent by each node, see test_report()
+#define TEST_FRAME_MS       10
+
+static bool busSend(uint8_t node, uint8_t toNode, const uint8_t *data, uint8_t len)
+{
+    twiTxBuf_t txBuf;
+
+    txBuf.toAddr = TEST_ADDR + toNode;
+    txBuf.len = len;
+    memcpy(txBuf.buffer, data, len);
+
+    return twiBusNode(node)->send(&txBuf);
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+// Master Transmitter to Slave Receiver
+void test_write_packet(void)
+{
+    static const uint8_t data[] = { 1, 2, 3 };
+    static const uint8_t master[] = { 0x08, 0x18, 0x28, 0x28, 0x28 };
+    static const uint8_t slave[] = { 0x60, 0x80, 0x80, 0x80, 0xa0 };
+    twiRxBuf_t rxBuf;
+
+    busInit(2, NULL);
+    TEST_ASSERT_TRUE(busSend(0, 1, data, sizeof(data)));
+    twiBusRun(5);
+
+    assertTrace(0, master, sizeof(master));
+    assertTrace(1, slave, sizeof(slave));
+    TEST_ASSERT_TRUE(twiBusNode(1)->recv(&rxBuf));
+    TEST_ASSERT_EQUAL(TEST_ADDR + 1, rxBuf.addr);
+    TEST_ASSERT_EQUAL(sizeof(data), rxBuf.size);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(data, rxBuf.buffer, sizeof(data));
+    TEST_ASSERT_EQUAL(0, twiBusNode(0)->txPending());
+    assertNoErrors();
+}
+
+// Bus busy time (CPU cycles) of a len bytes packet, with nodes
+// running at SCLFreq and ISR_Twi taking isrCycles
+template<uint32_t SCLFreq>
+static uint64_t busyCycles(uint32_t isrCycles, uint8_t len)
+{
+    static const uint8_t data[TWI_MAX_BUF] = { 0 };
+    twiBusStats_t bus;
+    uint8_t i;
+
+    twiBusInit(2, isrCycles, NULL);
+    for (i = 0; i < 2; i++)
+    {
+        twiBusNode(i)->initRate(TEST_ADDR + i, 0, 0, NULL,
+                                TwiBitRate<SCLFreq>::twbr,
+                                TwiBitRate<SCLFreq>::twps);
+    }
+    TEST_ASSERT_TRUE(busSend(0, 1, data, len));
+    twiBusRun(5);
+    assertNoErrors();
+    twiBusGetStats(&bus);
+
+    return bus.busyCycles;
+}
+
+// Fast-mode: a byte takes 4 times less on the wire than at
+// Standard-mode. A whole packet takes a bit more than a quarter,
+// the time ISR_Twi holds the bus (SCL stretched) does not scale
+void test_fast_mode(void)
+{
+    uint64_t byteStd = (busyCycles<TWI_SCL_STANDARD>(0, TWI_MAX_BUF) -
+                        busyCycles<TWI_SCL_STANDARD>(0, 1)) / (TWI_MAX_BUF - 1);
+    uint64_t byteFast = (busyCycles<TWI_SCL_FAST>(0, TWI_MAX_BUF) -
+                         busyCycles<TWI_SCL_FAST>(0, 1)) / (TWI_MAX_BUF - 1);
+    uint64_t packetStd = busyCycles<TWI_SCL_STANDARD>(TEST_ISR_CYCLES, TWI_MAX_BUF);
+    uint64_t packetFast = busyCycles<TWI_SCL_FAST>(TEST_ISR_CYCLES, TWI_MAX_BUF);
+
+    // 9 SCL periods of 160/40 cycles (100/400KHz)
+    TEST_ASSERT_EQUAL(9 * F_CPU / TWI_SCL_STANDARD, byteStd);
+    TEST_ASSERT_EQUAL(9 * F_CPU / TWI_SCL_FAST, byteFast);
+    TEST_ASSERT_TRUE(packetFast * 4 > packetStd);
+    TEST_ASSERT_TRUE(packetFast * 3 < packetStd);
+}
+
+// Two masters START at once to the same slave, the lowest data
+// byte wins, the other one backs off and sends it again
+void test_data_arbitration(void)
+{
+    static const uint8_t low[] = { 0x40, 1 };
+    static const uint8_t high[] = { 0x41, 2 };
+    twiBusStats_t bus;
+    twiStats_t stats0;
+    twiStats_t stats1;
+    twiRxBuf_t rxBuf;
+
+    busInit(3, NULL);
+    TEST_ASSERT_TRUE(busSend(0, 2, high, sizeof(high)));
+    TEST_ASSERT_TRUE(busSend(1, 2, low, sizeof(low)));
+    twiBusRun(50);
+
+    twiBusGetStats(&bus);
+    TEST_ASSERT_EQUAL(1, bus.collisions);
+    twiBusNode(0)->getStats(&stats0);
+    twiBusNode(1)->getStats(&stats1);
+    TEST_ASSERT_EQUAL(1, stats0.arbLosses);
+    TEST_ASSERT_EQUAL(0, stats1.arbLosses);
+    TEST_ASSERT_EQUAL(1, stats0.txFrames);
+    TEST_ASSERT_EQUAL(1, stats1.txFrames);
+
+    // Winner first
+    TEST_ASSERT_TRUE(twiBusNode(2)->recv(&rxBuf));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(low, rxBuf.buffer, sizeof(low));
+    TEST_ASSERT_TRUE(twiBusNode(2)->recv(&rxBuf));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(high, rxBuf.buffer, sizeof(high));
+    assertNoErrors();
+}
+
+// Arbitration lost in a data byte is told (0x38) at the end of the
+// bit lost, not of the byte: first bit differing, then the last one
+void test_arbitration_bit(void)
+{
+    static const uint8_t data[][2] = { { 0x80, 0x7f }, { 0x41, 0x40 } };
+    static const uint8_t loser[] = { 0x08, 0x18, 0x38 };
+    static const uint8_t bits[] = { 1, 8 };
+    const uint8_t *statuses;
+    uint8_t i;
+
+    for (i = 0; i < 2; i++)
+    {
+        busInit(3, NULL);
+        TEST_ASSERT_TRUE(busSend(0, 2, &data[i][0], 1));
+        TEST_ASSERT_TRUE(busSend(1, 2, &data[i][1], 1));
+        twiBusRun(1);
+
+        // 0x18 cleared by ISR_Twi, then bits until the one lost
+        TEST_ASSERT_GREATER_OR_EQUAL(sizeof(loser), twiBusTrace(0, &statuses));
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(loser, statuses, sizeof(loser));
+        TEST_ASSERT_EQUAL(TEST_ISR_CYCLES + bits[i] * (F_CPU / TWI_SCL_FREQ),
+                          twiBusTraceTime(0, 2) - twiBusTraceTime(0, 1));
+        assertNoErrors();
+    }
+}
+
+// A slave holding SDA low stops the bus, a master waiting to send
+// clears it (clocks SCL until SDA is released) once
+// TWI_STALL_TIMEOUT is over, then sends its packet
+void test_stuck_bus_cleared(void)
+{
+    static const uint8_t data[] = { 1 };
+    twiStats_t stats;
+    twiRxBuf_t rxBuf;
+
+    busInit(2, NULL);
+    twiBusStickSda(5);
+    TEST_ASSERT_TRUE(busSend(0, 1, data, sizeof(data)));
+    twiBusRun(TWI_STALL_TIMEOUT - 1);
+    twiBusNode(0)->getStats(&stats);
+    TEST_ASSERT_EQUAL(0, stats.busRecoveries);
+
+    twiBusRun(TWI_STALL_TIMEOUT + TWI_TX_BACKOFF + 2);
+    twiBusNode(0)->getStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.busRecoveries);
+    TEST_ASSERT_EQUAL(1, stats.txRetries);
+    TEST_ASSERT_EQUAL(1, stats.txFrames);
+    TEST_ASSERT_TRUE(twiBusNode(1)->recv(&rxBuf));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(data, rxBuf.buffer, sizeof(data));
+    assertNoErrors();
+}
+
+// Two masters START at once to each other, the one addressing the
+// lowest address wins, the other one is addressed (0x68) and sends
+// its packet once the bus is free
+void test_lost_to_own_address(void)
+{
+    static const uint8_t data[] = { 7 };
+    static const uint8_t loser[] = { 0x08, 0x68, 0x80, 0xa0, 0x08, 0x18, 0x28 };
+    static const uint8_t winner[] = { 0x08, 0x18, 0x28, 0x60, 0x80, 0xa0 };
+    twiStats_t stats;
+    twiRxBuf_t rxBuf;
+
+    busInit(2, NULL);
+    TEST_ASSERT_TRUE(busSend(0, 1, data, sizeof(data)));
+    TEST_ASSERT_TRUE(busSend(1, 0, data, sizeof(data)));
+    twiBusRun(5);
+
+    assertTrace(0, loser, sizeof(loser));
+    assertTrace(1, winner, sizeof(winner));
+    twiBusNode(0)->getStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.arbLosses);
+    TEST_ASSERT_TRUE(twiBusNode(0)->recv(&rxBuf));
+    TEST_ASSERT_TRUE(twiBusNode(1)->recv(&rxBuf));
+    assertNoErrors();
+}
+
+// General Call packet arriving with the receive ring full is
+// dropped (ACKed), not refused as a packet sent to us would be
+void test_gc_ring_full(void)
+{
+    static const uint8_t data[] = { 1 };
+    twiTxBuf_t txBuf;
+    twiStats_t stats;
+    uint8_t i;
+
+    busInit(2, NULL);
+    twiBusNode(1)->initRate(TEST_ADDR + 1, TWI_INIT_GENERAL_CALL, 0, NULL,
+                            TwiBitRate<TWI_SCL_FREQ>::twbr,
+                            TwiBitRate<TWI_SCL_FREQ>::twps);
+    for (i = 0; i < TWI_RX_QUEUE_DEPTH; i++)
+    {
+        TEST_ASSERT_TRUE(busSend(0, 1, data, sizeof(data)));
+        twiBusRun(2);
+    }
+    txBuf.toAddr = TWI_GC_ADDRESS;
+    txBuf.len = sizeof(data);
+    txBuf.buffer[0] = data[0];
+    TEST_ASSERT_TRUE(twiBusNode(0)->send(&txBuf));
+    twiBusRun(5);
+
+    twiBusNode(0)->getStats(&stats);
+    TEST_ASSERT_EQUAL(TWI_RX_QUEUE_DEPTH + 1, stats.txFrames);
+    TEST_ASSERT_EQUAL(0, stats.dataNacks);
+    twiBusNode(1)->getStats(&stats);
+    TEST_ASSERT_EQUAL(TWI_RX_QUEUE_DEPTH, stats.rxFrames);
+    TEST_ASSERT_EQUAL(1, stats.rxDropped);
+    TEST_ASSERT_EQUAL(0, stats.rxNacked);
+    assertNoErrors();
+}
+
+// A master waiting for a long transfer (longer than
+// TWI_STALL_TIMEOUT) to be over must not clear the bus
+void test_long_transfer_not_cleared(void)
+{
+    static uint8_t payload[200];
+    static const uint8_t data[] = { 1 };
+    twiSeg_t seg = { payload, sizeof(payload), false };
+    twiStats_t stats;
+    uint8_t i;
+
+    busInit(3, NULL);
+    TEST_ASSERT_TRUE(twiBusNode(0)->sendSg(TEST_ADDR + 1, &seg, 1));
+    twiBusRun(1);
+    TEST_ASSERT_TRUE(busSend(2, 1, data, sizeof(data)));
+    twiBusRun(40);
+
+    for (i = 0; i < 3; i++)
+    {
+        twiBusNode(i)->getStats(&stats);
+        TEST_ASSERT_EQUAL(0, stats.busRecoveries);
+    }
+    twiBusNode(2)->getStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.txFrames);
+    TEST_ASSERT_GREATER_OR_EQUAL(TWI_STALL_TIMEOUT, stats.txMaxWait);
+    twiBusNode(1)->getStats(&stats);
+    TEST_ASSERT_EQUAL(2, stats.rxFrames);
+    assertNoErrors();
+}
+
+// As pot_led, each node sends a frame every TEST_FRAME_MS and
+// consumes what it receives
+static void reportTick(uint8_t node)
+{
+    static uint8_t ms[TWI_BUS_MAX_NODES];
+    uint8_t data[6] = { node, 0, 0, 0, 0, 0 };
+    twiRxBuf_t rxBuf;
+
+    while (twiBusNode(node)->recv(&rxBuf))
+    {
+    }
+
+    if (++ms[node] >= TEST_FRAME_MS)
+    {
+        ms[node] = 0;
+        busSend(node, node ^ 1, data, sizeof(data));
+    }
+}
+
+// Bus utilization, frames per second and arbitration losses of
+// pot_led like traffic, two boards sending to each other
+void test_report(void)
+{
+    twiBusStats_t bus;
+    twiStats_t stats;
+    uint8_t i;
+
+    busInit(2, reportTick);
+    twiBusRun(1000);
+    twiBusReport("2 nodes, a frame every 10ms each");
+
+    twiBusGetStats(&bus);
+    TEST_ASSERT_TRUE(bus.busyCycles > 0 && bus.busyCycles < bus.cycles);
+    TEST_ASSERT_EQUAL(0, bus.errors);
+    for (i = 0; i < 2; i++)
+    {
+        twiBusNode(i)->getStats(&stats);
+        TEST_ASSERT_GREATER_OR_EQUAL(1000 / TEST_FRAME_MS - 1, stats.txFrames);
+        TEST_ASSERT_EQUAL(0, stats.txFailures);
+        TEST_ASSERT_EQUAL(0, stats.unexpected);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_write_packet);
+    RUN_TEST(test_fast_mode);
+    RUN_TEST(test_data_arbitration);
+    RUN_TEST(test_arbitration_bit);
+    RUN_TEST(test_stuck_bus_cleared);
+    RUN_TEST(test_lost_to_own_address);
+    RUN_TEST(test_gc_ring_full);
+    RUN_TEST(test_long_transfer_not_cleared);
+    RUN_TEST(test_report);
+
+    return UNITY_END();
+}
\ No newline at end of file
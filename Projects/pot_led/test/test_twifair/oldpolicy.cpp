@@ -0,0 +1,43 @@
+// Nodes running the driver as it was before winners held off and
+// losers built priority: a loser sends again after 1ms, packets are
+// chained without ever letting go of the bus (as close as it gets,
+// giving up after TWI_TX_MAX_ARB_LOSSES losses has no off switch).
+// Compared against in test_twifair.cpp
+
+#define TWI_ARB_WINDOW_MIN      1
+#define TWI_ARB_WINDOW_MAX      1
+#define TWI_TX_BURST            255
+#define TWI_TX_HOLD_WINDOW      0
+#define TWI_TX_MAX_ARB_LOSSES   255
+
+#include <string.h>
+
+#include <dbg.h>
+#include <twipriv.h>
+#include <twiapi.h>
+#include <twibus.h>
+
+#define TWI_BUS_NODE oldNode0
+#include <twinode.h>
+#define TWI_BUS_NODE oldNode1
+#include <twinode.h>
+#define TWI_BUS_NODE oldNode2
+#include <twinode.h>
+#define TWI_BUS_NODE oldNode3
+#include <twinode.h>
+#define TWI_BUS_NODE oldNode4
+#include <twinode.h>
+#define TWI_BUS_NODE oldNode5
+#include <twinode.h>
+#define TWI_BUS_NODE oldNode6
+#include <twinode.h>
+#define TWI_BUS_NODE oldNode7
+#include <twinode.h>
+
+extern const twiBusApi_t * const g_oldPolicyApis[TWI_BUS_MAX_NODES] =
+{
+    &oldNode0::g_twiBusApi, &oldNode1::g_twiBusApi,
+    &oldNode2::g_twiBusApi, &oldNode3::g_twiBusApi,
+    &oldNode4::g_twiBusApi, &oldNode5::g_twiBusApi,
+    &oldNode6::g_twiBusApi, &oldNode7::g_twiBusApi,
+};
\ No newline at end of file
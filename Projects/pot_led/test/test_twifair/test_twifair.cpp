@@ -0,0 +1,172 @@
+#include <unity.h>
+
+#include <twibustest.h>
+
+// Multi-master stress: every node sends a frame to the next one
+// every TEST_FRAME_MS, with 8 nodes that is more than the bus can
+// carry at 100KHz. Arbitration losers come back sooner the more
+// they lose, and winners that had to wait for the bus hold off (see
+// twiTxArbLost() and twiTxEnd()), so no node is starved (the one
+// addressing the lowest address would always win otherwise) and
+// the longest a packet waits to be sent stays bounded. Compared
+// against nodes running the former policy (see oldpolicy.cpp).
+
+#define TEST_FRAME_MS       4
+#define TEST_FRAME_LEN      6
+#define TEST_RUN_MS         2000
+
+// Frames offered by each node during a run
+#define TEST_OFFERED        (TEST_RUN_MS / TEST_FRAME_MS)
+
+// Longest wait (ms) allowed at the head of the send queue: a packet
+// losing every time waits up to TWI_ARB_WINDOW_MAX / 2, then / 4...
+// about TWI_ARB_WINDOW_MAX in all, plus the frames of the winners
+#define TEST_MAX_WAIT_MS    (2 * TWI_ARB_WINDOW_MAX)
+
+// Goodput of the busiest node over the least busy one
+#define TEST_MAX_UNFAIRNESS 2
+
+// Nodes with the former policy, see oldpolicy.cpp
+extern const twiBusApi_t * const g_oldPolicyApis[TWI_BUS_MAX_NODES];
+
+static uint8_t g_nodes;
+static uint8_t g_frameMs[TWI_BUS_MAX_NODES];
+
+// Consume what was received, send a frame every TEST_FRAME_MS
+// (dropped if the send queue is full, the bus is behind)
+static void stressTick(uint8_t node)
+{
+    twiTxBuf_t txBuf;
+    twiRxBuf_t rxBuf;
+
+    while (twiBusNode(node)->recv(&rxBuf))
+    {
+    }
+
+    if (++g_frameMs[node] >= TEST_FRAME_MS)
+    {
+        g_frameMs[node] = 0;
+        txBuf.toAddr = TEST_ADDR + (node + 1) % g_nodes;
+        txBuf.len = TEST_FRAME_LEN;
+        memset(txBuf.buffer, node, TEST_FRAME_LEN);
+        twiBusNode(node)->send(&txBuf);
+    }
+}
+
+// Run the stress with nodes masters, running the drivers in apis
+// (NULL for the current one)
+// Return the aggregate goodput (frames sent, all nodes), fewest and
+// most the frames sent by the least and the most busy node
+static uint32_t stressRun(uint8_t nodes, const twiBusApi_t * const *apis,
+                          const char *title, uint16_t *fewest, uint16_t *most)
+{
+    twiStats_t stats;
+    uint32_t frames = 0;
+    uint8_t i;
+
+    g_nodes = nodes;
+    if (apis != NULL)
+    {
+        twiBusInitApis(nodes, TEST_ISR_CYCLES, stressTick, apis);
+        for (i = 0; i < nodes; i++)
+        {
+            twiBusNode(i)->initRate(TEST_ADDR + i, 0, 0, NULL,
+                                    TwiBitRate<TWI_SCL_FREQ>::twbr,
+                                    TwiBitRate<TWI_SCL_FREQ>::twps);
+        }
+    }
+    else
+    {
+        busInit(nodes, stressTick);
+    }
+    for (i = 0; i < nodes; i++)
+    {
+        // Nodes do not start in step
+        g_frameMs[i] = i % TEST_FRAME_MS;
+    }
+    twiBusRun(TEST_RUN_MS);
+    twiBusReport(title);
+
+    assertNoErrors();
+    *fewest = 0xffff;
+    *most = 0;
+    for (i = 0; i < nodes; i++)
+    {
+        twiBusNode(i)->getStats(&stats);
+        frames += stats.txFrames;
+        TEST_ASSERT_EQUAL(0, stats.unexpected);
+        if (stats.txFrames < *fewest)
+        {
+            *fewest = stats.txFrames;
+        }
+        if (stats.txFrames > *most)
+        {
+            *most = stats.txFrames;
+        }
+        if (apis == NULL)
+        {
+            TEST_ASSERT_EQUAL(0, stats.txFailures);
+            TEST_ASSERT_LESS_OR_EQUAL(TEST_MAX_WAIT_MS, stats.txMaxWait);
+        }
+    }
+
+    return frames;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+// 4 masters offer less than the bus carries, nothing is held back
+// 8 masters offer twice as much, the bus carries more than with 4,
+// and shares it: no node gets more than TEST_MAX_UNFAIRNESS times
+// what another one gets
+void test_goodput(void)
+{
+    uint16_t fewest;
+    uint16_t most;
+    uint32_t goodput4 = stressRun(4, NULL, "4 masters", &fewest, &most);
+    uint32_t goodput8;
+
+    TEST_ASSERT_GREATER_OR_EQUAL(4 * (TEST_OFFERED - 1), goodput4);
+
+    goodput8 = stressRun(8, NULL, "8 masters", &fewest, &most);
+    TEST_ASSERT_GREATER_THAN(goodput4 + goodput4 / 4, goodput8);
+    TEST_ASSERT_LESS_OR_EQUAL(TEST_MAX_UNFAIRNESS * fewest, most);
+}
+
+// Same 8 masters with the former policy: the bus carries a bit more
+// overall (nobody ever holds off), but the nodes addressing higher
+// addresses are starved. The least busy node gets several times
+// more through now, for at most 15% less overall
+void test_old_policy(void)
+{
+    twiStats_t stats;
+    uint16_t fewest;
+    uint16_t oldFewest;
+    uint16_t most;
+    uint32_t goodput = stressRun(8, NULL, "8 masters", &fewest, &most);
+    uint32_t oldGoodput = stressRun(8, g_oldPolicyApis, "8 masters, former policy",
+                                    &oldFewest, &most);
+
+    TEST_ASSERT_LESS_THAN(TEST_OFFERED / 8, oldFewest);
+    // Node 6 (addressing the highest address) gives up on packets
+    // after TWI_TX_MAX_ARB_LOSSES, instead of waiting forever
+    twiBusNode(6)->getStats(&stats);
+    TEST_ASSERT_GREATER_THAN(0, stats.txFailures);
+    TEST_ASSERT_GREATER_THAN(4 * oldFewest, fewest);
+    TEST_ASSERT_GREATER_OR_EQUAL(oldGoodput - oldGoodput * 15 / 100, goodput);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_goodput);
+    RUN_TEST(test_old_policy);
+
+    return UNITY_END();
+}
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include <stdio.h>
+
+#include <unity.h>
+
+#include <twibustest.h>
+
+// Polled transfers (twiPollTransfer()), spinning on TWINT while the
+// bus model moves on
+
+// Bulk transfer, see test_poll_latency()
+#define TEST_BULK_LEN       64
+#define TEST_SLAVE_CYCLES   10
+
+static const uint8_t g_reply[] = { 0xa1, 0xb2, 0xc3, 0xd4 };
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+// Write then read after a repeated START, same states as through
+// ISR_Twi, nothing left pending afterwards
+void test_poll_write_read(void)
+{
+    static const uint8_t master[] = { 0x08, 0x18, 0x28, 0x28, 0x10, 0x40, 0x50, 0x58 };
+    static const uint8_t slave[] = { 0x60, 0x80, 0x80, 0xa0, 0xa8, 0xb8, 0xc0 };
+    static const uint8_t written[] = { 0x11, 0x22 };
+    uint8_t data[2];
+    twiStats_t stats;
+    twiRxBuf_t rxBuf;
+
+    busInit(2, NULL);
+    TEST_ASSERT_TRUE(twiBusNode(1)->setReply(g_reply, sizeof(g_reply)));
+    TEST_ASSERT_TRUE(twiBusNode(0)->pollTransfer(TEST_ADDR + 1, written, sizeof(written),
+                                                 data, sizeof(data), 10));
+    twiBusRun(1);
+
+    assertTrace(0, master, sizeof(master));
+    assertTrace(1, slave, sizeof(slave));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(g_reply, data, sizeof(data));
+    TEST_ASSERT_TRUE(twiBusNode(1)->recv(&rxBuf));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(written, rxBuf.buffer, sizeof(written));
+    twiBusNode(0)->getStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.txFrames);
+    TEST_ASSERT_FALSE(twiBusNode(0)->busy());
+    assertNoErrors();
+}
+
+// Nobody answers: SLA+W NACKed, fails without retrying
+void test_poll_absent(void)
+{
+    static const uint8_t data[] = { 1 };
+    twiStats_t stats;
+
+    busInit(1, NULL);
+    TEST_ASSERT_FALSE(twiBusNode(0)->pollTransfer(TEST_ADDR + 1, data, sizeof(data),
+                                                  NULL, 0, 10));
+    twiBusNode(0)->getStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.addrNacks);
+    TEST_ASSERT_EQUAL(0, stats.busRecoveries);
+    TEST_ASSERT_FALSE(twiBusNode(0)->busy());
+    assertNoErrors();
+}
+
+// Arbitration lost to a master addressing us, writing (0x68) or
+// reading (0xb0): the polled transfer fails, ISR_Twi serves that
+// master right away, it does not have to send again
+void test_poll_lost_to_own_address(void)
+{
+    static const uint8_t data[] = { 7 };
+    static const uint8_t written[] = { 0x08, 0x68, 0x80, 0xa0 };
+    static const uint8_t read[] = { 0x08, 0xb0, 0xb8, 0xc0 };
+    twiStats_t stats;
+    twiRxBuf_t rxBuf;
+    twiTxBuf_t *txBuf;
+    uint8_t rd;
+
+    for (rd = 0; rd < 2; rd++)
+    {
+        busInit(3, NULL);
+        TEST_ASSERT_TRUE(twiBusNode(0)->setReply(g_reply, 2));
+        // SLA+R/W to node 0 is lower than SLA+W to node 2
+        txBuf = twiBusNode(1)->txAcquire();
+        txBuf->toAddr = TEST_ADDR;
+        txBuf->len = rd ? 0 : sizeof(data);
+        txBuf->rdLen = rd ? 2 : 0;
+        txBuf->buffer[0] = data[0];
+        TEST_ASSERT_TRUE(twiBusNode(1)->txCommit(txBuf));
+        TEST_ASSERT_FALSE(twiBusNode(0)->pollTransfer(TEST_ADDR + 2, data, sizeof(data),
+                                                      NULL, 0, 10));
+        twiBusRun(5);
+
+        assertTrace(0, rd ? read : written, 4);
+        twiBusNode(0)->getStats(&stats);
+        TEST_ASSERT_EQUAL(1, stats.arbLosses);
+        TEST_ASSERT_EQUAL(0, stats.txFrames);
+        TEST_ASSERT_EQUAL(rd ? 0 : 1, stats.rxFrames);
+        TEST_ASSERT_FALSE(twiBusNode(0)->busy());
+        twiBusNode(1)->getStats(&stats);
+        TEST_ASSERT_EQUAL(1, stats.txFrames);
+        TEST_ASSERT_EQUAL(0, stats.txRetries);
+        TEST_ASSERT_TRUE(twiBusNode(rd ? 1 : 0)->recv(&rxBuf));
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(rd ? g_reply : data, rxBuf.buffer, rxBuf.size);
+        assertNoErrors();
+    }
+}
+
+// Bus busy time (CPU cycles) of a TEST_BULK_LEN bytes write at
+// SCLFreq, polled or through ISR_Twi (from segments, as it is not
+// limited by TWI_MAX_BUF either), to a slave quick to clear TWINT
+// (e.g. an I2C LED driver) so that only the master holds SCL low
+template<uint32_t SCLFreq>
+static uint64_t bulkCycles(bool polled)
+{
+    static uint8_t payload[TEST_BULK_LEN];
+    twiSeg_t seg = { payload, sizeof(payload), false };
+    twiBusStats_t bus;
+    uint8_t i;
+
+    twiBusInit(2, TEST_ISR_CYCLES, NULL);
+    twiBusSetIsrCycles(1, TEST_SLAVE_CYCLES);
+    for (i = 0; i < 2; i++)
+    {
+        twiBusNode(i)->initRate(TEST_ADDR + i, 0, 0, NULL,
+                                TwiBitRate<SCLFreq>::twbr,
+                                TwiBitRate<SCLFreq>::twps);
+    }
+    if (polled)
+    {
+        TEST_ASSERT_TRUE(twiBusNode(0)->pollTransfer(TEST_ADDR + 1, payload, sizeof(payload),
+                                                     NULL, 0, 20));
+    }
+    else
+    {
+        TEST_ASSERT_TRUE(twiBusNode(0)->sendSg(TEST_ADDR + 1, &seg, 1));
+    }
+    twiBusRun(20);
+    assertNoErrors();
+    twiBusGetStats(&bus);
+
+    return bus.busyCycles;
+}
+
+// Polled transfers hold the bus (SCL low) TWI_BUS_POLL_CYCLES after
+// each byte, instead of the ISR_Twi time (TEST_ISR_CYCLES): the table
+// gets through about 5% faster at 100KHz, 17% at 400KHz
+void test_poll_latency(void)
+{
+    uint64_t isrStd = bulkCycles<TWI_SCL_STANDARD>(false);
+    uint64_t pollStd = bulkCycles<TWI_SCL_STANDARD>(true);
+    uint64_t isrFast = bulkCycles<TWI_SCL_FAST>(false);
+    uint64_t pollFast = bulkCycles<TWI_SCL_FAST>(true);
+
+    printf("%u bytes at 100KHz: ISR_Twi %lu us, polled %lu us\n", TEST_BULK_LEN,
+           (unsigned long)(isrStd / (F_CPU / 1000000UL)),
+           (unsigned long)(pollStd / (F_CPU / 1000000UL)));
+    printf("%u bytes at 400KHz: ISR_Twi %lu us, polled %lu us\n", TEST_BULK_LEN,
+           (unsigned long)(isrFast / (F_CPU / 1000000UL)),
+           (unsigned long)(pollFast / (F_CPU / 1000000UL)));
+
+    // At least half the ISR time saved on each byte
+    TEST_ASSERT_TRUE(pollStd + TEST_BULK_LEN * TEST_ISR_CYCLES / 2 < isrStd);
+    TEST_ASSERT_TRUE(pollFast + TEST_BULK_LEN * TEST_ISR_CYCLES / 2 < isrFast);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_poll_write_read);
+    RUN_TEST(test_poll_absent);
+    RUN_TEST(test_poll_lost_to_own_address);
+    RUN_TEST(test_poll_latency);
+
+    return UNITY_END();
+}
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include <unity.h>
+
+#include <twibustest.h>
+
+// Master Receiver (0x40-0x58) and Slave Transmitter (0xa8-0xc8)
+// states, as seen by ISR_Twi of both ends on the bus model
+
+// Nobody answers it
+#define TEST_ABSENT_ADDR    0x30
+
+static const uint8_t g_reply[] = { 0xa1, 0xb2, 0xc3, 0xd4 };
+
+// Queue a packet writing len bytes (0x11, 0x22...) then reading rdLen
+static bool busTransfer(uint8_t node, uint8_t toAddr, uint8_t len, uint8_t rdLen)
+{
+    twiTxBuf_t *txBuf = twiBusNode(node)->txAcquire();
+    uint8_t i;
+
+    if (txBuf == NULL)
+    {
+        return false;
+    }
+
+    txBuf->toAddr = toAddr;
+    txBuf->len = len;
+    txBuf->rdLen = rdLen;
+    for (i = 0; i < len; i++)
+    {
+        txBuf->buffer[i] = 0x11 * (i + 1);
+    }
+
+    return twiBusNode(node)->txCommit(txBuf);
+}
+
+// Reply read as master is received as a packet
+static void assertReply(uint8_t node, uint8_t fromNode, const uint8_t *data, uint8_t len)
+{
+    twiRxBuf_t rxBuf;
+
+    TEST_ASSERT_TRUE(twiBusNode(node)->recv(&rxBuf));
+    TEST_ASSERT_TRUE(rxBuf.status & TWI_RX_MasterRead);
+    TEST_ASSERT_TRUE(rxBuf.status & TWI_RX_RecvCompleted);
+    TEST_ASSERT_EQUAL(TEST_ADDR + fromNode, rxBuf.addr);
+    TEST_ASSERT_EQUAL(len, rxBuf.size);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(data, rxBuf.buffer, len);
+}
+
+static void assertClean(uint8_t nodes)
+{
+    twiStats_t stats;
+    uint8_t i;
+
+    assertNoErrors();
+    for (i = 0; i < nodes; i++)
+    {
+        twiBusNode(i)->getStats(&stats);
+        TEST_ASSERT_EQUAL(0, stats.unexpected);
+        TEST_ASSERT_FALSE(twiBusNode(i)->busy());
+    }
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+// Read only (len 0): 0x40, 0x50, 0x58 / 0xa8, 0xb8, 0xc0
+void test_master_read(void)
+{
+    static const uint8_t master[] = { 0x08, 0x40, 0x50, 0x50, 0x50, 0x58 };
+    static const uint8_t slave[] = { 0xa8, 0xb8, 0xb8, 0xb8, 0xc0 };
+    twiStats_t stats;
+
+    busInit(2, NULL);
+    TEST_ASSERT_TRUE(twiBusNode(1)->setReply(g_reply, sizeof(g_reply)));
+    TEST_ASSERT_TRUE(busTransfer(0, TEST_ADDR + 1, 0, sizeof(g_reply)));
+    twiBusRun(5);
+
+    assertTrace(0, master, sizeof(master));
+    assertTrace(1, slave, sizeof(slave));
+    assertReply(0, 1, g_reply, sizeof(g_reply));
+    twiBusNode(0)->getStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.txFrames);
+    TEST_ASSERT_EQUAL(1, stats.rxFrames);
+    assertClean(2);
+}
+
+// Write then read after a repeated START, the slave sees the
+// repeated START as the end of the packet written (0xa0)
+void test_write_then_read(void)
+{
+    static const uint8_t master[] = { 0x08, 0x18, 0x28, 0x28, 0x10, 0x40, 0x50, 0x58 };
+    static const uint8_t slave[] = { 0x60, 0x80, 0x80, 0xa0, 0xa8, 0xb8, 0xc0 };
+    static const uint8_t written[] = { 0x11, 0x22 };
+    twiRxBuf_t rxBuf;
+
+    busInit(2, NULL);
+    TEST_ASSERT_TRUE(twiBusNode(1)->setReply(g_reply, sizeof(g_reply)));
+    TEST_ASSERT_TRUE(busTransfer(0, TEST_ADDR + 1, 2, 2));
+    twiBusRun(5);
+
+    assertTrace(0, master, sizeof(master));
+    assertTrace(1, slave, sizeof(slave));
+    assertReply(0, 1, g_reply, 2);
+    TEST_ASSERT_TRUE(twiBusNode(1)->recv(&rxBuf));
+    TEST_ASSERT_FALSE(rxBuf.status & TWI_RX_MasterRead);
+    TEST_ASSERT_EQUAL(sizeof(written), rxBuf.size);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(written, rxBuf.buffer, sizeof(written));
+    assertClean(2);
+}
+
+// Master reads past the reply: the slave sends its last byte
+// expecting NACK, gets ACK (0xc8), the rest reads as 0xff
+void test_read_past_reply(void)
+{
+    static const uint8_t master[] = { 0x08, 0x40, 0x50, 0x50, 0x50, 0x58 };
+    static const uint8_t slave[] = { 0xa8, 0xb8, 0xc8 };
+    static const uint8_t data[] = { 0xa1, 0xb2, 0xff, 0xff };
+
+    busInit(2, NULL);
+    TEST_ASSERT_TRUE(twiBusNode(1)->setReply(g_reply, 2));
+    TEST_ASSERT_TRUE(busTransfer(0, TEST_ADDR + 1, 0, sizeof(data)));
+    twiBusRun(5);
+
+    assertTrace(0, master, sizeof(master));
+    assertTrace(1, slave, sizeof(slave));
+    assertReply(0, 1, data, sizeof(data));
+    assertClean(2);
+}
+
+// SLA+R not ACKed (0x48): one repeated START, then attempts with
+// back off until TWI_TX_MAX_ATTEMPTS
+void test_read_absent(void)
+{
+    static const uint8_t attempt[] = { 0x08, 0x48, 0x10, 0x48 };
+    const uint8_t *statuses;
+    twiStats_t stats;
+    uint16_t len;
+    uint16_t i;
+
+    busInit(1, NULL);
+    TEST_ASSERT_TRUE(busTransfer(0, TEST_ABSENT_ADDR, 0, 2));
+    twiBusRun(100);
+
+    len = twiBusTrace(0, &statuses);
+    TEST_ASSERT_EQUAL(sizeof(attempt) * TWI_TX_MAX_ATTEMPTS, len);
+    for (i = 0; i < len; i += sizeof(attempt))
+    {
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(attempt, statuses + i, sizeof(attempt));
+    }
+    twiBusNode(0)->getStats(&stats);
+    TEST_ASSERT_EQUAL(2 * TWI_TX_MAX_ATTEMPTS, stats.addrNacks);
+    TEST_ASSERT_EQUAL(TWI_TX_MAX_ATTEMPTS - 1, stats.txRetries);
+    TEST_ASSERT_EQUAL(1, stats.txFailures);
+    TEST_ASSERT_EQUAL(0, stats.txFrames);
+    TEST_ASSERT_EQUAL(0, twiBusNode(0)->txPending());
+    assertClean(1);
+}
+
+// Arbitration lost to a master reading from us (0xb0): we reply,
+// then send our own packet
+void test_lost_to_read(void)
+{
+    static const uint8_t reader[] = { 0x08, 0x40, 0x50, 0x58 };
+    static const uint8_t loser[] = { 0x08, 0xb0, 0xb8, 0xc0, 0x08, 0x18, 0x28 };
+    twiStats_t stats;
+    twiRxBuf_t rxBuf;
+
+    busInit(3, NULL);
+    TEST_ASSERT_TRUE(twiBusNode(1)->setReply(g_reply, 2));
+    // SLA+R to node 1 is lower than SLA+W to node 2
+    TEST_ASSERT_TRUE(busTransfer(0, TEST_ADDR + 1, 0, 2));
+    TEST_ASSERT_TRUE(busTransfer(1, TEST_ADDR + 2, 1, 0));
+    twiBusRun(5);
+
+    assertTrace(0, reader, sizeof(reader));
+    assertTrace(1, loser, sizeof(loser));
+    assertReply(0, 1, g_reply, 2);
+    twiBusNode(1)->getStats(&stats);
+    TEST_ASSERT_EQUAL(1, stats.arbLosses);
+    TEST_ASSERT_EQUAL(1, stats.txFrames);
+    TEST_ASSERT_TRUE(twiBusNode(2)->recv(&rxBuf));
+    assertClean(3);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_master_read);
+    RUN_TEST(test_write_then_read);
+    RUN_TEST(test_read_past_reply);
+    RUN_TEST(test_read_absent);
+    RUN_TEST(test_lost_to_read);
+
+    return UNITY_END();
+}
\ No newline at end of file